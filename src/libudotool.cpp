@@ -0,0 +1,2024 @@
+#include <cstring>
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <math.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <strings.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <utility>
+
+#include "udotool_internal.h"
+
+//the same for every device, the rest of the configuration is in the Config of each one
+int DEVICE_INIT_DELAY_MILLIS = 200; //fallback, when readiness cannot be detected
+int DEVICE_READY_TIMEOUT_MILLIS = 2000;
+int DEVICE_READY_SETTLE_MILLIS = 5;
+
+int TOUCH_SLOT_COUNT = 10;
+const int TOUCH_AXES[] = {
+  ABS_X, ABS_Y, ABS_MT_SLOT, ABS_MT_TRACKING_ID, ABS_MT_POSITION_X, ABS_MT_POSITION_Y,
+};
+
+const char* DEV_INPUT_DIR = "/dev/input";
+const char* UDEV_DATA_DIR = "/run/udev/data";
+
+//prints an error and returns false if the sink cannot be opened
+bool openSink(EventSink* sink, int type, const char* path, const KeySet* keys, const Config* config) {
+  return openSinks(sink, 1, type, path, keys, config);
+}
+
+//count uinput devices are named "NAME 1" to "NAME N", for the device name NAME of config,
+//  and count record files are PATH.1 to PATH.N, unless count is 1
+//every device is created before waiting for any of them, so that udev processes
+//  them together, and the settle delay is paid once
+//prints an error, closes the sinks that were opened and returns false if one cannot be opened
+bool openSinks(EventSink* sinks, int count, int type, const char* path, const KeySet* keys, const Config* config) {
+  const char* deviceName = config->options.deviceName;
+  for (int i = 0; i < count; i++) {
+    sinks[i].type = type;
+    sinks[i].fd = -1;
+    sinks[i].devPath[0] = '\0';
+    sinks[i].keys = *keys;
+    sinks[i].pointerTypes = config->options.pointerTypes;
+    addPointerKeys(&sinks[i].keys, sinks[i].pointerTypes);
+  }
+
+  if (type == SINK_UINPUT) {
+    //watch before UI_DEV_CREATE, so that no node creation can be missed
+    int inotifyFD = watchDeviceDirs();
+    for (int i = 0; i < count; i++) {
+      char name[UINPUT_MAX_NAME_SIZE];
+      if (count > 1) {
+        snprintf(name, sizeof(name), "%s %d", deviceName, i + 1);
+      } else {
+        snprintf(name, sizeof(name), "%s", deviceName);
+      }
+      sinks[i].fd = createDevice(&sinks[i].keys, name, config);
+      if (sinks[i].fd < 0) {
+        for (int j = 0; j < i; j++) {
+          closeSink(&sinks[j], config);
+        }
+        if (inotifyFD >= 0) {
+          close(inotifyFD);
+        }
+        return false;
+      }
+    }
+
+    bool detected = true;
+    for (int i = 0; i < count; i++) {
+      detected = waitForDevice(sinks[i].fd, inotifyFD, sinks[i].devPath, sizeof(sinks[i].devPath)) && detected;
+    }
+    if (inotifyFD >= 0) {
+      close(inotifyFD);
+    }
+    //give listeners a moment to open the nodes after udev announces them
+    usleep((detected ? DEVICE_READY_SETTLE_MILLIS : DEVICE_INIT_DELAY_MILLIS) * 1000);
+    markPhase(config->stats, PHASE_SETTLE);
+  } else if (type == SINK_RECORD) {
+    if (path == NULL) {
+      printf("ERROR: a record sink needs the path of a file\n");
+      return false;
+    }
+    for (int i = 0; i < count; i++) {
+      char recordPath[PATH_MAX];
+      if (count > 1) {
+        snprintf(recordPath, sizeof(recordPath), "%s.%d", path, i + 1);
+      } else {
+        snprintf(recordPath, sizeof(recordPath), "%s", path);
+      }
+      sinks[i].fd = open(recordPath, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+      if (sinks[i].fd < 0) {
+        printf("ERROR: could not open %s (%s)\n", recordPath, strerror(errno));
+        for (int j = 0; j < i; j++) {
+          closeSink(&sinks[j], config);
+        }
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+void closeSink(EventSink* sink, const Config* config) {
+  if (sink->type == SINK_UINPUT) {
+    closeDevice(sink->fd);
+    markPhase(config->stats, PHASE_DESTROY);
+  } else if (sink->fd >= 0) {
+    close(sink->fd);
+  }
+  sink->fd = -1;
+}
+
+const char* sinkName(const EventSink* sink) {
+  switch (sink->type) {
+    case SINK_UINPUT: return "uinput";
+    case SINK_NULL:   return "null";
+    case SINK_RECORD: return "record file";
+  }
+  return "unknown";
+}
+
+//sets up and creates the device, as the pointers and touch size of config, without waiting for it to be ready
+//  keys must include the buttons of the pointer (see addPointerKeys)
+//prints an error and returns -1 if /dev/uinput cannot be opened, or the device cannot be created
+int createDevice(const KeySet* keys, const char* name, const Config* config) {
+  int uinputFD = open("/dev/uinput", O_WRONLY | O_NONBLOCK);
+  if (uinputFD < 0) {
+    printf("ERROR: could not open /dev/uinput (%s)\n", strerror(errno));
+    return -1;
+  }
+  markPhase(config->stats, PHASE_OPEN);
+
+  ioctl(uinputFD, UI_SET_EVBIT, EV_KEY);
+  for (int i=0; i < KEY_CNT; i++) {
+    if (keys->test(i)) {
+      ioctl(uinputFD, UI_SET_KEYBIT, i);
+    }
+  }
+
+  int pointerTypes = config->options.pointerTypes;
+  if (pointerTypes & POINTER_MOUSE) {
+    ioctl(uinputFD, UI_SET_EVBIT, EV_REL);
+    ioctl(uinputFD, UI_SET_RELBIT, REL_X);
+    ioctl(uinputFD, UI_SET_RELBIT, REL_Y);
+  }
+  if (pointerTypes & POINTER_TOUCH) {
+    ioctl(uinputFD, UI_SET_EVBIT, EV_ABS);
+    for (int axis : TOUCH_AXES) {
+      ioctl(uinputFD, UI_SET_ABSBIT, axis);
+    }
+    ioctl(uinputFD, UI_SET_PROPBIT, INPUT_PROP_DIRECT);
+  }
+
+  if (!setupDevice(uinputFD, name, config)) {
+    close(uinputFD);
+    return -1;
+  }
+  markPhase(config->stats, PHASE_SETUP);
+
+  if (ioctl(uinputFD, UI_DEV_CREATE) < 0) {
+    printf("ERROR: could not create the uinput device (%s)\n", strerror(errno));
+    close(uinputFD);
+    return -1;
+  }
+  markPhase(config->stats, PHASE_CREATE);
+  return uinputFD;
+}
+
+//UI_DEV_SETUP (linux 4.5+), falling back to writing a uinput_user_dev on older kernels
+//prints an error and returns false if neither works
+bool setupDevice(int uinputFD, const char* name, const Config* config) {
+  bool touch = config->options.pointerTypes & POINTER_TOUCH;
+#ifdef UI_DEV_SETUP
+  struct uinput_setup uinputSetup;
+  memset(&uinputSetup, 0, sizeof(uinputSetup));
+  snprintf(uinputSetup.name, UINPUT_MAX_NAME_SIZE, "%s", name);
+  if (ioctl(uinputFD, UI_DEV_SETUP, &uinputSetup) == 0) {
+    for (int axis : TOUCH_AXES) {
+      if (!touch) {
+        break;
+      }
+      struct uinput_abs_setup absSetup;
+      memset(&absSetup, 0, sizeof(absSetup));
+      absSetup.code = axis;
+      absSetup.absinfo.maximum = touchAxisMax(axis, config);
+      ioctl(uinputFD, UI_ABS_SETUP, &absSetup);
+    }
+    return true;
+  }
+#endif
+
+  struct uinput_user_dev uinputDev;
+  memset(&uinputDev, 0, sizeof(uinputDev));
+  snprintf(uinputDev.name, UINPUT_MAX_NAME_SIZE, "%s", name);
+  for (int axis : TOUCH_AXES) {
+    if (touch) {
+      uinputDev.absmax[axis] = touchAxisMax(axis, config);
+    }
+  }
+  if (write(uinputFD, &uinputDev, sizeof(uinputDev)) != sizeof(uinputDev)) {
+    printf("ERROR: could not set up the uinput device (%s)\n", strerror(errno));
+    return false;
+  }
+  return true;
+}
+
+//returns an inotify fd watching /dev/input (and the udev database, if present), or -1
+int watchDeviceDirs() {
+  int inotifyFD = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (inotifyFD < 0) {
+    return -1;
+  }
+  if (inotify_add_watch(inotifyFD, DEV_INPUT_DIR, IN_CREATE | IN_ATTRIB) < 0) {
+    close(inotifyFD);
+    return -1;
+  }
+  //udev writes the database entry after running its rules and before notifying
+  //  listeners like libinput, so it is a better readiness signal than the node alone
+  inotify_add_watch(inotifyFD, UDEV_DATA_DIR, IN_CREATE | IN_MOVED_TO);
+  return inotifyFD;
+}
+
+//waits until the event node of the new device exists, can be opened,
+//  and (when udev is running) has been processed by udev
+//returns false if that cannot be detected, e.g.: kernels before 3.15 without UI_GET_SYSNAME,
+//  or if it timed out; the caller then falls back to DEVICE_INIT_DELAY_MILLIS
+bool waitForDevice(int uinputFD, int inotifyFD, char* devPath, size_t devPathSize) {
+#ifdef UI_GET_SYSNAME
+  char sysName[64];
+  if (inotifyFD < 0 || ioctl(uinputFD, UI_GET_SYSNAME(sizeof(sysName)), sysName) < 0) {
+    return false;
+  }
+
+  char eventName[32];
+  unsigned major, minor;
+  if (!findEventNode(sysName, eventName, sizeof(eventName), &major, &minor)) {
+    return false;
+  }
+
+  snprintf(devPath, devPathSize, "%s/%s", DEV_INPUT_DIR, eventName);
+
+  char udevDataPath[64];
+  snprintf(udevDataPath, sizeof(udevDataPath), "%s/c%u:%u", UDEV_DATA_DIR, major, minor);
+
+  struct stat st;
+  bool hasUdev = stat(UDEV_DATA_DIR, &st) == 0;
+
+  long long deadline = nowNanos() + DEVICE_READY_TIMEOUT_MILLIS * 1000000LL;
+  while (!isDeviceReady(devPath, hasUdev ? udevDataPath : NULL)) {
+    long long remainingMillis = (deadline - nowNanos()) / 1000000LL;
+    if (remainingMillis <= 0) {
+      printf("WARNING: timed out waiting for %s\n", devPath);
+      return false;
+    }
+
+    struct pollfd pfd = {inotifyFD, POLLIN, 0};
+    if (poll(&pfd, 1, remainingMillis) > 0) {
+      char buf[4096];
+      while (read(inotifyFD, buf, sizeof(buf)) > 0) {
+      }
+    }
+  }
+  return true;
+#else
+  return false;
+#endif
+}
+
+//finds e.g.: 'event5' and its device number in /sys/class/input/SYSNAME/
+bool findEventNode(const char* sysName, char* eventName, size_t eventNameSize, unsigned* major, unsigned* minor) {
+  char sysPath[256];
+  snprintf(sysPath, sizeof(sysPath), "/sys/class/input/%s", sysName);
+
+  DIR* dir = opendir(sysPath);
+  if (dir == NULL) {
+    return false;
+  }
+  bool found = false;
+  struct dirent* entry;
+  while (!found && (entry = readdir(dir)) != NULL) {
+    if (strncmp(entry->d_name, "event", 5) == 0) {
+      snprintf(eventName, eventNameSize, "%s", entry->d_name);
+      found = true;
+    }
+  }
+  closedir(dir);
+  if (!found) {
+    return false;
+  }
+
+  char devNumPath[512];
+  snprintf(devNumPath, sizeof(devNumPath), "%s/%s/dev", sysPath, eventName);
+  FILE* devNumFile = fopen(devNumPath, "r");
+  if (devNumFile == NULL) {
+    return false;
+  }
+  found = fscanf(devNumFile, "%u:%u", major, minor) == 2;
+  fclose(devNumFile);
+  return found;
+}
+
+bool isDeviceReady(const char* devPath, const char* udevDataPath) {
+  if (udevDataPath != NULL && access(udevDataPath, F_OK) != 0) {
+    return false;
+  }
+  int fd = open(devPath, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+  if (fd < 0) {
+    return false;
+  }
+  close(fd);
+  return true;
+}
+
+//adds the time since the previous mark to phase, unless stats is NULL
+void markPhase(Stats* stats, int phase) {
+  if (stats == NULL) {
+    return;
+  }
+  long long now = nowNanos();
+  long long elapsed = now - stats->lastMarkNanos;
+  stats->phaseNanos[phase] += elapsed;
+  stats->lastMarkNanos = now;
+  if (stats->trace) {
+    printf("trace: %-8s %10.3fms\n", PHASE_NAMES[phase], elapsed / 1e6);
+  }
+}
+
+void recordLatency(LatencyHistogram* hist, long long nanos) {
+  hist->count++;
+  hist->buckets[latencyBucket(nanos)]++;
+  if (nanos > hist->maxNanos) {
+    hist->maxNanos = nanos;
+  }
+}
+
+//the power of two, plus the two bits below the highest set bit
+int latencyBucket(long long nanos) {
+  if (nanos < 4) {
+    return nanos < 0 ? 0 : nanos;
+  }
+  int log2 = 63 - __builtin_clzll(nanos);
+  return log2 * 4 + ((nanos >> (log2 - 2)) & 3);
+}
+
+//the lowest latency that falls in bucket
+long long latencyBucketNanos(int bucket) {
+  if (bucket < 4) {
+    return bucket;
+  }
+  int log2 = bucket / 4;
+  return (1LL << log2) + (bucket % 4) * (1LL << (log2 - 2));
+}
+
+long long latencyPercentile(const LatencyHistogram* hist, double percentile) {
+  long long target = hist->count * percentile / 100.0;
+  long long seen = 0;
+  for (int i = 0; i < LATENCY_BUCKET_COUNT; i++) {
+    seen += hist->buckets[i];
+    if (seen > target) {
+      return latencyBucketNanos(i);
+    }
+  }
+  return hist->maxNanos;
+}
+
+long long nowNanos() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+void closeDevice(int uinputFD) {
+  ioctl(uinputFD, UI_DEV_DESTROY);
+  close(uinputFD);
+}
+
+//returns false if the command is unknown or malformed, without emitting anything,
+//  or if any of its events could not be written
+bool runCommand(EventBuffer* evBuf, const char* cmd, const char* arg) {
+  CommandPlan plan;
+  if (!compileCommand(cmd, arg, evBuf->config, &plan)
+    || !checkCommandPlan(&evBuf->sink, &plan)
+  ) {
+    return false;
+  }
+  return emitCommandPlan(evBuf, &plan);
+}
+
+//compiles any script command with config, without writing anything
+//  the keystrokes of 'type' are paced at its keystroke rate and burst, and motion frames at its frame rate
+//prints an error and returns false if the command is unknown or malformed
+bool compileCommand(const char* cmd, const char* arg, Config* config, CommandPlan* plan) {
+  if (strcmp(cmd, "type") == 0) {
+    TypePlan typePlan;
+    if (!compileTypePlan(arg, &config->layout, &typePlan)) {
+      return false;
+    }
+    planTypeFrames(plan, &typePlan, config->options.keystrokeRate, config->options.keystrokeBurst);
+    return true;
+  } else if (strcmp(cmd, "key") == 0 || strcmp(cmd, "keydown") == 0 || strcmp(cmd, "keyup") == 0) {
+    KeyCmd keyCmd;
+    if (!extractKeyCmd(arg, &keyCmd)) {
+      return false;
+    }
+    TypePlan keyPlan;
+    bool ok = compileKeyCmd(keyCmd, strcmp(cmd, "keyup") != 0, strcmp(cmd, "keydown") != 0, &keyPlan);
+    free(keyCmd.keyName);
+    if (!ok) {
+      return false;
+    }
+    plan->events = std::move(keyPlan.events);
+    plan->frameEnds.push_back(plan->events.size());
+    plan->frameNanos.push_back(0);
+    return true;
+  } else if (motionCommandType(cmd) != 0) {
+    MotionPlan motionPlan;
+    if (!compileMotionPlan(cmd, arg, config, &motionPlan)) {
+      return false;
+    }
+    plan->events = std::move(motionPlan.events);
+    plan->frameEnds = std::move(motionPlan.frameEnds);
+    for (size_t i = 0; i < plan->frameEnds.size(); i++) {
+      plan->frameNanos.push_back(i * 1000000000LL / config->options.frameRate);
+    }
+    plan->pointerTypes = motionCommandType(cmd);
+    return true;
+  } else if (strcmp(cmd, "sleep") == 0) {
+    long millis;
+    if (!parseSleepArg(arg, &millis)) {
+      return false;
+    }
+    plan->sleepNanos = millis * 1000000LL;
+    return true;
+  } else if (strcmp(cmd, "rate") == 0) {
+    long rate;
+    if (!parseRateArg(arg, &rate)) {
+      return false;
+    }
+    plan->rate = rate;
+    return true;
+  } else {
+    printf("ERROR: unknown command %s\n", cmd);
+    return false;
+  }
+}
+
+//like the deadlines of a Pacer, each burst of keystrokes is one frame, due at its own
+//  deadline from the start; with no rate, the whole string is one frame
+void planTypeFrames(CommandPlan* plan, TypePlan* typePlan, int rate, int burst) {
+  size_t keystrokeCount = typePlan->keystrokeEnds.size();
+  if (rate > 0) {
+    for (size_t k = burst; k < keystrokeCount; k += burst) {
+      plan->frameEnds.push_back(typePlan->keystrokeEnds[k - 1]);
+      plan->frameNanos.push_back((k - burst) * 1000000000LL / rate);
+    }
+  }
+  size_t lastStart = plan->frameEnds.size() * burst;
+  plan->frameEnds.push_back(typePlan->events.size());
+  plan->frameNanos.push_back(rate > 0 ? lastStart * 1000000000LL / rate : 0);
+  plan->events = std::move(typePlan->events);
+  plan->keystrokeCount = keystrokeCount;
+}
+
+//prints an error and returns false if the plan needs a pointer or a key the device of sink
+//  does not have, instead of writing events the kernel would silently drop
+bool checkCommandPlan(const EventSink* sink, const CommandPlan* plan) {
+  int missingPointers = plan->pointerTypes & ~sink->pointerTypes;
+  if (missingPointers != 0) {
+    printf("ERROR: the device is not a %s\n", missingPointers & POINTER_MOUSE ? "mouse" : "touchscreen");
+    return false;
+  }
+  //a release follows the press of the same key, so only a change of key is looked up
+  int checkedCode = -1;
+  for (const struct input_event& evt : plan->events) {
+    if (evt.type == EV_KEY && evt.code != checkedCode) {
+      if (!sink->keys.test(evt.code)) {
+        printf("ERROR: the device does not have key code %d\n", evt.code);
+        return false;
+      }
+      checkedCode = evt.code;
+    }
+  }
+  return true;
+}
+
+//writes each frame in one write() at its deadline from now, and then waits out a 'sleep'
+//  a 'rate' sets the keystroke rate of evBuf's config, for the commands after it
+//  returns false if any of the events could not be written
+bool emitCommandPlan(EventBuffer* evBuf, const CommandPlan* plan) {
+  Config* config = evBuf->config;
+  if (plan->rate >= 0) {
+    config->options.keystrokeRate = plan->rate;
+  }
+  Pacer pacer;
+  initPacer(&pacer, config->options.keystrokeRate, config->options.keystrokeBurst);
+
+  bool ok = flushEvents(evBuf);
+  size_t start = 0;
+  for (size_t i = 0; i < plan->frameEnds.size(); i++) {
+    size_t end = plan->frameEnds[i];
+    if (plan->frameNanos[i] > 0) {
+      sleepUntil(pacer.startNanos + plan->frameNanos[i]);
+    }
+    ok = queueEvents(evBuf, plan->events.data() + start, end - start) && ok;
+    ok = flushEvents(evBuf) && ok;
+    start = end;
+  }
+  if (plan->sleepNanos > 0) {
+    sleepUntil(pacer.startNanos + plan->sleepNanos);
+  }
+
+  if (plan->keystrokeCount > 0) {
+    pacer.endNanos = nowNanos();
+    pacer.keystrokeCount = plan->keystrokeCount;
+    if (config->stats != NULL) {
+      config->stats->keystrokeCount += plan->keystrokeCount;
+      config->stats->typingNanos += pacer.endNanos - pacer.startNanos;
+    }
+    if (config->reportRate) {
+      reportPacer(&pacer);
+    }
+  }
+  return ok;
+}
+
+//prints an error and returns false unless arg is a number of milliseconds
+bool parseSleepArg(const char* arg, long* millis) {
+  char* end;
+  *millis = strtol(arg, &end, 10);
+  if (end == arg || *end != '\0' || *millis < 0) {
+    printf("ERROR: invalid sleep millis %s\n", arg);
+    return false;
+  }
+  return true;
+}
+
+//prints an error and returns false unless arg is a keystroke rate
+bool parseRateArg(const char* arg, long* rate) {
+  char* end;
+  *rate = strtol(arg, &end, 10);
+  if (end == arg || *end != '\0' || *rate < 0 || *rate > 1000000000L) {
+    printf("ERROR: invalid rate %s\n", arg);
+    return false;
+  }
+  return true;
+}
+
+//the queue functions return false if the buffer was full and flushing it failed
+bool emitKeyEvent(EventBuffer* evBuf, int keyCode, bool pressed) {
+   bool ok = queueEvent(evBuf, EV_KEY, keyCode, pressed ? 1 : 0);
+   return queueEvent(evBuf, EV_SYN, SYN_REPORT, 0) && ok;
+}
+
+bool queueEvent(EventBuffer* evBuf, int type, int code, int val) {
+   bool ok = true;
+   if (evBuf->count >= EVENT_BUFFER_SIZE) {
+     ok = flushEvents(evBuf);
+   }
+
+   struct input_event* evt = &evBuf->events[evBuf->count++];
+
+   evt->type = type;
+   evt->code = code;
+   evt->value = val;
+
+   evt->time.tv_sec = 0;  //ignored
+   evt->time.tv_usec = 0; //ignored
+   return ok;
+}
+
+bool queueEvents(EventBuffer* evBuf, const struct input_event* events, int count) {
+   bool ok = true;
+   while (count > 0) {
+     if (evBuf->count >= EVENT_BUFFER_SIZE) {
+       ok = flushEvents(evBuf) && ok;
+     }
+     int n = EVENT_BUFFER_SIZE - evBuf->count;
+     if (n > count) {
+       n = count;
+     }
+     memcpy(&evBuf->events[evBuf->count], events, n * sizeof(struct input_event));
+     evBuf->count += n;
+     events += n;
+     count -= n;
+   }
+   return ok;
+}
+
+//writes all queued events, waiting with poll() while the sink reports EAGAIN,
+//  and resuming after short writes
+//returns false and counts the dropped events if the write fails or times out
+bool flushEvents(EventBuffer* evBuf) {
+   const char* data = (const char*)evBuf->events;
+   size_t remaining = evBuf->count * sizeof(struct input_event);
+
+   if (evBuf->sink.type == SINK_RECORD) {
+     stampEvents(evBuf->events, evBuf->count);
+   }
+   evBuf->count = 0;
+
+   while (remaining > 0) {
+     ssize_t n = writeSink(evBuf, data, remaining);
+     if (n > 0) {
+       data += n;
+       remaining -= n;
+       if (remaining > 0) {
+         evBuf->shortWriteCount++;
+       }
+       continue;
+     }
+
+     if (n < 0 && errno == EINTR) {
+       continue;
+     } else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+       evBuf->eagainCount++;
+       //a signal restarts the wait, for what is left of the write timeout
+       struct pollfd pfd = {evBuf->sink.fd, POLLOUT, 0};
+       long long deadline = nowNanos() + evBuf->config->options.writeTimeoutMillis * 1000000LL;
+       int ready;
+       do {
+         long long remainingMillis = (deadline - nowNanos()) / 1000000LL;
+         ready = remainingMillis > 0 ? poll(&pfd, 1, remainingMillis) : 0;
+       } while (ready < 0 && errno == EINTR);
+       if (ready > 0) {
+         continue;
+       } else if (ready == 0) {
+         printf("ERROR: timed out waiting to write to %s\n", sinkName(&evBuf->sink));
+       } else {
+         printf("ERROR: waiting to write to %s failed (%s)\n", sinkName(&evBuf->sink), strerror(errno));
+       }
+     } else {
+       printf("ERROR: write to %s failed (%s)\n", sinkName(&evBuf->sink),
+         n < 0 ? strerror(errno) : "no progress");
+     }
+
+     evBuf->failedWriteCount++;
+     evBuf->droppedEventCount += (remaining + sizeof(struct input_event) - 1) / sizeof(struct input_event);
+     return false;
+   }
+   return true;
+}
+
+//one write() of size bytes of events, counted in evBuf and the stats of its config, without retrying
+//  returns what write() returns, or size for the null sink
+ssize_t writeSink(EventBuffer* evBuf, const char* data, size_t size) {
+   Stats* stats = evBuf->config->stats;
+   if (evBuf->sink.type == SINK_NULL) {
+     evBuf->eventCount += size / sizeof(struct input_event);
+     if (stats != NULL) {
+       stats->eventCount += size / sizeof(struct input_event);
+     }
+     return size;
+   }
+
+   bool timed = stats != NULL && stats->enabled;
+   long long writeStartNanos = timed ? nowNanos() : 0;
+   ssize_t n = write(evBuf->sink.fd, data, size);
+   if (timed) {
+     stats->syscallCount++;
+     recordLatency(&stats->writeLatency, nowNanos() - writeStartNanos);
+     stats->byteCount += n > 0 ? n : 0;
+     stats->eventCount += n > 0 ? n / sizeof(struct input_event) : 0;
+   }
+   if (n > 0) {
+     evBuf->writeCount++;
+     evBuf->eventCount += n / sizeof(struct input_event);
+   }
+   return n;
+}
+
+//record files get the time they are written, as evdev would timestamp them
+void stampEvents(struct input_event* events, int count) {
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   for (int i = 0; i < count; i++) {
+     events[i].time.tv_sec = ts.tv_sec;
+     events[i].time.tv_usec = ts.tv_nsec / 1000;
+   }
+}
+
+//prints the write counters and returns false if any events were dropped
+bool reportWriteErrors(EventBuffer* evBuf) {
+  if (evBuf->droppedEventCount == 0) {
+    return true;
+  }
+  printf("ERROR: dropped %ld events"
+    " (%ld failed writes, %ld writes, %ld EAGAIN retries, %ld short writes)\n",
+    evBuf->droppedEventCount, evBuf->failedWriteCount,
+    evBuf->writeCount, evBuf->eagainCount, evBuf->shortWriteCount);
+  return false;
+}
+
+constexpr CharKeyTable buildCharKeyTable() {
+  CharKeyTable table = {};
+  table.keys[(unsigned char)'\n']   = {KEY_ENTER,       0};
+  table.keys[(unsigned char)'\033'] = {KEY_ESC,         0};
+  table.keys[(unsigned char)'\t']   = {KEY_TAB,         0};
+  table.keys[(unsigned char)' ']    = {KEY_SPACE,       0};
+  table.keys[(unsigned char)'!']    = {KEY_1,           MOD_SHIFT};
+  table.keys[(unsigned char)'"']    = {KEY_APOSTROPHE,  MOD_SHIFT};
+  table.keys[(unsigned char)'#']    = {KEY_3,           MOD_SHIFT};
+  table.keys[(unsigned char)'$']    = {KEY_4,           MOD_SHIFT};
+  table.keys[(unsigned char)'%']    = {KEY_5,           MOD_SHIFT};
+  table.keys[(unsigned char)'&']    = {KEY_7,           MOD_SHIFT};
+  table.keys[(unsigned char)'\'']   = {KEY_APOSTROPHE,  0};
+  table.keys[(unsigned char)'(']    = {KEY_9,           MOD_SHIFT};
+  table.keys[(unsigned char)')']    = {KEY_0,           MOD_SHIFT};
+  table.keys[(unsigned char)'*']    = {KEY_8,           MOD_SHIFT};
+  table.keys[(unsigned char)'+']    = {KEY_EQUAL,       MOD_SHIFT};
+  table.keys[(unsigned char)',']    = {KEY_COMMA,       0};
+  table.keys[(unsigned char)'-']    = {KEY_MINUS,       0};
+  table.keys[(unsigned char)'.']    = {KEY_DOT,         0};
+  table.keys[(unsigned char)'/']    = {KEY_SLASH,       0};
+  table.keys[(unsigned char)'0']    = {KEY_0,           0};
+  table.keys[(unsigned char)'1']    = {KEY_1,           0};
+  table.keys[(unsigned char)'2']    = {KEY_2,           0};
+  table.keys[(unsigned char)'3']    = {KEY_3,           0};
+  table.keys[(unsigned char)'4']    = {KEY_4,           0};
+  table.keys[(unsigned char)'5']    = {KEY_5,           0};
+  table.keys[(unsigned char)'6']    = {KEY_6,           0};
+  table.keys[(unsigned char)'7']    = {KEY_7,           0};
+  table.keys[(unsigned char)'8']    = {KEY_8,           0};
+  table.keys[(unsigned char)'9']    = {KEY_9,           0};
+  table.keys[(unsigned char)':']    = {KEY_SEMICOLON,   MOD_SHIFT};
+  table.keys[(unsigned char)';']    = {KEY_SEMICOLON,   0};
+  table.keys[(unsigned char)'<']    = {KEY_COMMA,       MOD_SHIFT};
+  table.keys[(unsigned char)'=']    = {KEY_EQUAL,       0};
+  table.keys[(unsigned char)'>']    = {KEY_DOT,         MOD_SHIFT};
+  table.keys[(unsigned char)'?']    = {KEY_SLASH,       MOD_SHIFT};
+  table.keys[(unsigned char)'@']    = {KEY_2,           MOD_SHIFT};
+  table.keys[(unsigned char)'A']    = {KEY_A,           MOD_SHIFT};
+  table.keys[(unsigned char)'B']    = {KEY_B,           MOD_SHIFT};
+  table.keys[(unsigned char)'C']    = {KEY_C,           MOD_SHIFT};
+  table.keys[(unsigned char)'D']    = {KEY_D,           MOD_SHIFT};
+  table.keys[(unsigned char)'E']    = {KEY_E,           MOD_SHIFT};
+  table.keys[(unsigned char)'F']    = {KEY_F,           MOD_SHIFT};
+  table.keys[(unsigned char)'G']    = {KEY_G,           MOD_SHIFT};
+  table.keys[(unsigned char)'H']    = {KEY_H,           MOD_SHIFT};
+  table.keys[(unsigned char)'I']    = {KEY_I,           MOD_SHIFT};
+  table.keys[(unsigned char)'J']    = {KEY_J,           MOD_SHIFT};
+  table.keys[(unsigned char)'K']    = {KEY_K,           MOD_SHIFT};
+  table.keys[(unsigned char)'L']    = {KEY_L,           MOD_SHIFT};
+  table.keys[(unsigned char)'M']    = {KEY_M,           MOD_SHIFT};
+  table.keys[(unsigned char)'N']    = {KEY_N,           MOD_SHIFT};
+  table.keys[(unsigned char)'O']    = {KEY_O,           MOD_SHIFT};
+  table.keys[(unsigned char)'P']    = {KEY_P,           MOD_SHIFT};
+  table.keys[(unsigned char)'Q']    = {KEY_Q,           MOD_SHIFT};
+  table.keys[(unsigned char)'R']    = {KEY_R,           MOD_SHIFT};
+  table.keys[(unsigned char)'S']    = {KEY_S,           MOD_SHIFT};
+  table.keys[(unsigned char)'T']    = {KEY_T,           MOD_SHIFT};
+  table.keys[(unsigned char)'U']    = {KEY_U,           MOD_SHIFT};
+  table.keys[(unsigned char)'V']    = {KEY_V,           MOD_SHIFT};
+  table.keys[(unsigned char)'W']    = {KEY_W,           MOD_SHIFT};
+  table.keys[(unsigned char)'X']    = {KEY_X,           MOD_SHIFT};
+  table.keys[(unsigned char)'Y']    = {KEY_Y,           MOD_SHIFT};
+  table.keys[(unsigned char)'Z']    = {KEY_Z,           MOD_SHIFT};
+  table.keys[(unsigned char)'[']    = {KEY_LEFTBRACE,   0};
+  table.keys[(unsigned char)'\\']   = {KEY_BACKSLASH,   0};
+  table.keys[(unsigned char)']']    = {KEY_RIGHTBRACE,  0};
+  table.keys[(unsigned char)'^']    = {KEY_6,           MOD_SHIFT};
+  table.keys[(unsigned char)'_']    = {KEY_MINUS,       MOD_SHIFT};
+  table.keys[(unsigned char)'`']    = {KEY_GRAVE,       0};
+  table.keys[(unsigned char)'a']    = {KEY_A,           0};
+  table.keys[(unsigned char)'b']    = {KEY_B,           0};
+  table.keys[(unsigned char)'c']    = {KEY_C,           0};
+  table.keys[(unsigned char)'d']    = {KEY_D,           0};
+  table.keys[(unsigned char)'e']    = {KEY_E,           0};
+  table.keys[(unsigned char)'f']    = {KEY_F,           0};
+  table.keys[(unsigned char)'g']    = {KEY_G,           0};
+  table.keys[(unsigned char)'h']    = {KEY_H,           0};
+  table.keys[(unsigned char)'i']    = {KEY_I,           0};
+  table.keys[(unsigned char)'j']    = {KEY_J,           0};
+  table.keys[(unsigned char)'k']    = {KEY_K,           0};
+  table.keys[(unsigned char)'l']    = {KEY_L,           0};
+  table.keys[(unsigned char)'m']    = {KEY_M,           0};
+  table.keys[(unsigned char)'n']    = {KEY_N,           0};
+  table.keys[(unsigned char)'o']    = {KEY_O,           0};
+  table.keys[(unsigned char)'p']    = {KEY_P,           0};
+  table.keys[(unsigned char)'q']    = {KEY_Q,           0};
+  table.keys[(unsigned char)'r']    = {KEY_R,           0};
+  table.keys[(unsigned char)'s']    = {KEY_S,           0};
+  table.keys[(unsigned char)'t']    = {KEY_T,           0};
+  table.keys[(unsigned char)'u']    = {KEY_U,           0};
+  table.keys[(unsigned char)'v']    = {KEY_V,           0};
+  table.keys[(unsigned char)'w']    = {KEY_W,           0};
+  table.keys[(unsigned char)'x']    = {KEY_X,           0};
+  table.keys[(unsigned char)'y']    = {KEY_Y,           0};
+  table.keys[(unsigned char)'z']    = {KEY_Z,           0};
+  table.keys[(unsigned char)'{']    = {KEY_LEFTBRACE,   MOD_SHIFT};
+  table.keys[(unsigned char)'|']    = {KEY_BACKSLASH,   MOD_SHIFT};
+  table.keys[(unsigned char)'}']    = {KEY_RIGHTBRACE,  MOD_SHIFT};
+  table.keys[(unsigned char)'~']    = {KEY_GRAVE,       MOD_SHIFT};
+  return table;
+}
+
+constexpr CharKeyTable CHAR_KEYS = buildCharKeyTable();
+
+//prints an error for every character that cannot be typed, and returns false if there are any
+//  str is UTF-8, typed as it is on layout, and ASCII bytes are looked up without decoding
+bool compileTypePlan(const char* str, const Layout* layout, TypePlan* plan) {
+  bool ok = true;
+  int len = strlen(str);
+  plan->events.reserve(len * 8 + 2);
+  plan->keystrokeEnds.reserve(len);
+
+  planKeyEvent(plan, KEY_LEFTSHIFT, false);
+
+  //modifiers stay held between consecutive characters that need them,
+  //  so only the transitions are sent
+  int mods = 0;
+  for (int i = 0; i < len; ) {
+    int start = i;
+    long codePoint;
+    CharKey charKey;
+    if ((unsigned char)str[i] < 0x80 && layout->header == NULL) {
+      codePoint = str[i++];
+      charKey = CHAR_KEYS.keys[codePoint];
+    } else {
+      codePoint = decodeUtf8(str, &i);
+      if (codePoint < 0) {
+        printf("ERROR: invalid UTF-8 at index %d\n", start);
+        ok = false;
+        continue;
+      }
+      charKey = lookupCharKey(layout, codePoint);
+    }
+
+    if (charKey.keyCode == 0) {
+      printf("ERROR: cannot type character U+%04lX at index %d\n", codePoint, start);
+      ok = false;
+    } else if (ok) {
+      planCharKey(plan, &mods, layout, charKey);
+      plan->keystrokeEnds.push_back(plan->events.size());
+    }
+  }
+  if (!ok) {
+    plan->events.clear();
+    plan->keystrokeEnds.clear();
+    return false;
+  }
+
+  //always leave every modifier released, as part of the last keystroke
+  planModTransition(plan, &mods, 0);
+  if (!plan->keystrokeEnds.empty()) {
+    plan->keystrokeEnds.back() = plan->events.size();
+  }
+  return true;
+}
+
+void planKeyEvent(TypePlan* plan, int keyCode, bool pressed) {
+  struct input_event evt;
+  memset(&evt, 0, sizeof(evt));
+
+  evt.type = EV_KEY;
+  evt.code = keyCode;
+  evt.value = pressed ? 1 : 0;
+  plan->events.push_back(evt);
+
+  evt.type = EV_SYN;
+  evt.code = SYN_REPORT;
+  evt.value = 0;
+  plan->events.push_back(evt);
+}
+
+//releases modifiers that are not in targetMods (in reverse order), and then presses new ones
+void planModTransition(TypePlan* plan, int* curMods, int targetMods) {
+  for (int i = MOD_KEY_COUNT - 1; i >= 0; i--) {
+    int mod = MOD_KEYS[i][0];
+    if ((*curMods & mod) && !(targetMods & mod)) {
+      planKeyEvent(plan, MOD_KEYS[i][1], false);
+    }
+  }
+  for (int i = 0; i < MOD_KEY_COUNT; i++) {
+    int mod = MOD_KEYS[i][0];
+    if (!(*curMods & mod) && (targetMods & mod)) {
+      planKeyEvent(plan, MOD_KEYS[i][1], true);
+    }
+  }
+  *curMods = targetMods;
+}
+
+//one keystroke, after the layout's dead key if there is one
+void planCharKey(TypePlan* plan, int* mods, const Layout* layout, CharKey charKey) {
+  if (charKey.deadKey != 0) {
+    CharKey deadKey = layout->deadKeys[charKey.deadKey - 1];
+    planModTransition(plan, mods, deadKey.mods);
+    planKeyEvent(plan, deadKey.keyCode, true);
+    planKeyEvent(plan, deadKey.keyCode, false);
+  }
+  planModTransition(plan, mods, charKey.mods);
+  planKeyEvent(plan, charKey.keyCode, true);
+  planKeyEvent(plan, charKey.keyCode, false);
+}
+
+//returns the code point of the UTF-8 sequence at str[*index], and moves *index past it
+//  returns -1 for invalid, overlong or truncated sequences and surrogates,
+//  and moves *index past the first byte
+long decodeUtf8(const char* str, int* index) {
+  const unsigned char* bytes = (const unsigned char*)str + *index;
+  int len;
+  long codePoint;
+  if (bytes[0] < 0x80) {
+    len = 1;
+    codePoint = bytes[0];
+  } else if ((bytes[0] & 0xe0) == 0xc0) {
+    len = 2;
+    codePoint = bytes[0] & 0x1f;
+  } else if ((bytes[0] & 0xf0) == 0xe0) {
+    len = 3;
+    codePoint = bytes[0] & 0x0f;
+  } else if ((bytes[0] & 0xf8) == 0xf0) {
+    len = 4;
+    codePoint = bytes[0] & 0x07;
+  } else {
+    *index += 1;
+    return -1;
+  }
+
+  for (int i = 1; i < len; i++) {
+    if ((bytes[i] & 0xc0) != 0x80) {
+      *index += 1;
+      return -1;
+    }
+    codePoint = (codePoint << 6) | (bytes[i] & 0x3f);
+  }
+
+  const long minCodePoint[] = {0, 0, 0x80, 0x800, 0x10000};
+  if (codePoint < minCodePoint[len] || codePoint > 0x10ffff
+    || (codePoint >= 0xd800 && codePoint <= 0xdfff)
+  ) {
+    *index += 1;
+    return -1;
+  }
+  *index += len;
+  return codePoint;
+}
+
+//the built-in US table, or the page of the loaded layout
+CharKey lookupCharKey(const Layout* layout, long codePoint) {
+  CharKey none = {0, 0, 0};
+  if (layout->header == NULL) {
+    return codePoint < 256 ? CHAR_KEYS.keys[codePoint] : none;
+  }
+  if (codePoint >= LAYOUT_INDEX_SIZE * 256) {
+    return none;
+  }
+  int page = layout->header->pageIndex[codePoint >> 8];
+  CharKey charKey = layout->pages[page * 256 + (codePoint & 0xff)];
+  return charKey.deadKey <= layout->header->deadKeyCount ? charKey : none;
+}
+
+//layoutName is a file if it contains a '/', and otherwise LAYOUT_DIR/NAME.kbd
+//  'us' is the built-in layout
+//the file is mapped read-only for the life of the process
+bool loadLayout(const char* layoutName, Layout* layout) {
+  if (strcmp(layoutName, "us") == 0) {
+    return true;
+  }
+
+  std::string path = layoutName;
+  if (strchr(layoutName, '/') == NULL) {
+    path = std::string(LAYOUT_DIR) + "/" + layoutName + ".kbd";
+  }
+
+  int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    printf("ERROR: could not open layout %s (%s)\n", path.c_str(), strerror(errno));
+    return false;
+  }
+
+  struct stat st;
+  const char* data = (const char*)MAP_FAILED;
+  if (fstat(fd, &st) == 0 && st.st_size >= (off_t)sizeof(LayoutHeader)) {
+    data = (const char*)mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  }
+  close(fd);
+
+  const LayoutHeader* header = (const LayoutHeader*)data;
+  bool ok = data != MAP_FAILED
+    && memcmp(header->magic, LAYOUT_MAGIC, sizeof(header->magic)) == 0
+    && header->pageCount > 0
+    && st.st_size == (off_t)(sizeof(LayoutHeader)
+      + (header->deadKeyCount + header->pageCount * 256ULL) * sizeof(CharKey));
+  for (int i = 0; ok && i < LAYOUT_INDEX_SIZE; i++) {
+    ok = header->pageIndex[i] < header->pageCount;
+  }
+  if (!ok) {
+    printf("ERROR: %s is not a udotool layout\n", path.c_str());
+    if (data != MAP_FAILED) {
+      munmap((void*)data, st.st_size);
+    }
+    return false;
+  }
+
+  layout->header = header;
+  layout->deadKeys = (const CharKey*)(data + sizeof(LayoutHeader));
+  layout->pages = layout->deadKeys + header->deadKeyCount;
+  layout->mapSize = st.st_size;
+  return true;
+}
+
+//back to the built-in US layout
+void unloadLayout(Layout* layout) {
+  if (layout->header != NULL) {
+    munmap((void*)layout->header, layout->mapSize);
+  }
+  *layout = Layout();
+}
+
+//the POINTER_* type a command needs, or 0 if it is not a motion command
+int motionCommandType(const char* cmd) {
+  if (strcmp(cmd, "mousemove") == 0 || strcmp(cmd, "click") == 0) {
+    return POINTER_MOUSE;
+  } else if (strcmp(cmd, "tap") == 0 || strcmp(cmd, "swipe") == 0) {
+    return POINTER_TOUCH;
+  }
+  return 0;
+}
+
+//prints an error and returns false if the args are malformed
+//  (whether the device acts as the pointer the command needs is up to checkCommandPlan)
+//  a touch takes the next tracking id of config
+bool compileMotionPlan(const char* cmd, const char* arg, Config* config, MotionPlan* plan) {
+  long v[5];
+  if (strcmp(cmd, "mousemove") == 0) {
+    int count = parseMotionArgs(cmd, arg, v, 2, 3, config);
+    if (count < 0) {
+      return false;
+    }
+    //each step moves to the rounded point on the line, so the steps add up to DX,DY exactly
+    int frames = motionFrameCount(count == 3 ? v[2] : 0, config);
+    long prevX = 0, prevY = 0;
+    for (int i = 1; i <= frames; i++) {
+      long x = lround((double)v[0] * i / frames);
+      long y = lround((double)v[1] * i / frames);
+      planMotionEvent(plan, EV_REL, REL_X, x - prevX);
+      planMotionEvent(plan, EV_REL, REL_Y, y - prevY);
+      planMotionFrame(plan);
+      prevX = x;
+      prevY = y;
+    }
+  } else if (strcmp(cmd, "click") == 0) {
+    int button;
+    if (arg[0] == '\0' || strcmp(arg, "left") == 0) {
+      button = BTN_LEFT;
+    } else if (strcmp(arg, "right") == 0) {
+      button = BTN_RIGHT;
+    } else if (strcmp(arg, "middle") == 0) {
+      button = BTN_MIDDLE;
+    } else {
+      printf("ERROR: unknown mouse button %s\n", arg);
+      return false;
+    }
+    planMotionEvent(plan, EV_KEY, button, 1);
+    planMotionFrame(plan);
+    planMotionEvent(plan, EV_KEY, button, 0);
+    planMotionFrame(plan);
+  } else if (strcmp(cmd, "tap") == 0) {
+    if (parseMotionArgs(cmd, arg, v, 2, 2, config) < 0) {
+      return false;
+    }
+    planTouch(plan, v[0], v[1], true, config);
+    planTouch(plan, v[0], v[1], false, config);
+  } else if (strcmp(cmd, "swipe") == 0) {
+    int count = parseMotionArgs(cmd, arg, v, 4, 5, config);
+    if (count < 0) {
+      return false;
+    }
+    int frames = motionFrameCount(count == 5 ? v[4] : config->options.swipeMillis, config);
+    planTouch(plan, v[0], v[1], true, config);
+    for (int i = 1; i <= frames; i++) {
+      planTouch(plan,
+        v[0] + lround((double)(v[2] - v[0]) * i / frames),
+        v[1] + lround((double)(v[3] - v[1]) * i / frames),
+        true, config);
+    }
+    planTouch(plan, v[2], v[3], false, config);
+  }
+  return true;
+}
+
+//parses minCount to maxCount space-separated integers into values, and returns how many
+//  prints an error and returns -1 if the args are malformed, or a coordinate is off the touchscreen
+int parseMotionArgs(const char* cmd, const char* arg, long* values, int minCount, int maxCount, const Config* config) {
+  int count = 0;
+  const char* pos = arg;
+  while (*pos != '\0') {
+    char* end;
+    long value = strtol(pos, &end, 10);
+    if (end == pos || (*end != ' ' && *end != '\0') || count == maxCount) {
+      count = -1;
+      break;
+    }
+    values[count++] = value;
+    pos = end;
+    while (*pos == ' ') {
+      pos++;
+    }
+  }
+  if (count < minCount) {
+    printf("ERROR: invalid args for %s: '%s'\n", cmd, arg);
+    return -1;
+  }
+
+  //touch coordinates are X,Y pairs, followed by MILLIS
+  bool touch = motionCommandType(cmd) == POINTER_TOUCH;
+  for (int i = 0; i < count; i++) {
+    bool isX = touch && i < minCount && i % 2 == 0;
+    bool isY = touch && i < minCount && i % 2 == 1;
+    bool isMillis = i >= minCount;
+    if ((isX && (values[i] < 0 || values[i] >= config->options.touchWidth))
+      || (isY && (values[i] < 0 || values[i] >= config->options.touchHeight))
+      || (isMillis && values[i] < 0)
+    ) {
+      printf("ERROR: %s arg out of range: %ld\n", cmd, values[i]);
+      return -1;
+    }
+  }
+  return count;
+}
+
+//frames for a motion lasting millis, at least one
+int motionFrameCount(long millis, const Config* config) {
+  long frames = millis * config->options.frameRate / 1000;
+  return frames < 1 ? 1 : frames > 1000000 ? 1000000 : frames;
+}
+
+//EV_REL events with no motion are left out
+void planMotionEvent(MotionPlan* plan, int type, int code, int value) {
+  if (type == EV_REL && value == 0) {
+    return;
+  }
+  struct input_event evt;
+  memset(&evt, 0, sizeof(evt));
+  evt.type = type;
+  evt.code = code;
+  evt.value = value;
+  plan->events.push_back(evt);
+}
+
+//ends the frame with SYN_REPORT, unless it is empty
+void planMotionFrame(MotionPlan* plan) {
+  size_t start = plan->frameEnds.empty() ? 0 : plan->frameEnds.back();
+  if (plan->events.size() > start) {
+    planMotionEvent(plan, EV_SYN, SYN_REPORT, 0);
+  }
+  plan->frameEnds.push_back(plan->events.size());
+}
+
+//one frame of a single finger in slot 0: touching down (or moving) to X,Y, or lifting
+//  with the single-touch ABS_X/ABS_Y and BTN_TOUCH, for older readers
+void planTouch(MotionPlan* plan, long x, long y, bool down, Config* config) {
+  planMotionEvent(plan, EV_ABS, ABS_MT_SLOT, 0);
+  if (down && !plan->touching) {
+    planMotionEvent(plan, EV_ABS, ABS_MT_TRACKING_ID, config->touchTrackingId);
+    config->touchTrackingId = (config->touchTrackingId + 1) % (touchAxisMax(ABS_MT_TRACKING_ID, config) + 1);
+  }
+  if (down) {
+    planMotionEvent(plan, EV_ABS, ABS_MT_POSITION_X, x);
+    planMotionEvent(plan, EV_ABS, ABS_MT_POSITION_Y, y);
+    planMotionEvent(plan, EV_ABS, ABS_X, x);
+    planMotionEvent(plan, EV_ABS, ABS_Y, y);
+  } else {
+    planMotionEvent(plan, EV_ABS, ABS_MT_TRACKING_ID, -1);
+  }
+  if (down != plan->touching) {
+    planMotionEvent(plan, EV_KEY, BTN_TOUCH, down ? 1 : 0);
+  }
+  plan->touching = down;
+  planMotionFrame(plan);
+}
+
+int touchAxisMax(int axis, const Config* config) {
+  switch (axis) {
+    case ABS_X:
+    case ABS_MT_POSITION_X:  return config->options.touchWidth - 1;
+    case ABS_Y:
+    case ABS_MT_POSITION_Y:  return config->options.touchHeight - 1;
+    case ABS_MT_SLOT:        return TOUCH_SLOT_COUNT - 1;
+    case ABS_MT_TRACKING_ID: return 65535;
+  }
+  return 0;
+}
+
+void initPacer(Pacer* pacer, int rate, int burst) {
+  pacer->rate = rate;
+  pacer->burst = burst;
+  pacer->startNanos = nowNanos();
+  pacer->endNanos = pacer->startNanos;
+  pacer->keystrokeCount = 0;
+}
+
+//call before queueing each keystroke
+//  at the start of each burst, flushes what is queued and sleeps until the burst's deadline
+//  with an unlimited rate, events are only flushed when the buffer fills up
+//returns false if the flush failed
+
+void sleepUntil(long long deadlineNanos) {
+  struct timespec deadline;
+  deadline.tv_sec = deadlineNanos / 1000000000LL;
+  deadline.tv_nsec = deadlineNanos % 1000000000LL;
+  while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL) == EINTR) {
+  }
+}
+
+//the first keystroke goes out at the start, so the achieved rate counts the intervals after it
+void reportPacer(Pacer* pacer) {
+  long long elapsedNanos = pacer->endNanos - pacer->startNanos;
+  double achieved = 0;
+  if (pacer->keystrokeCount > 1 && elapsedNanos > 0) {
+    achieved = (pacer->keystrokeCount - 1) * 1e9 / elapsedNanos;
+  }
+
+  char target[32];
+  if (pacer->rate > 0) {
+    snprintf(target, sizeof(target), "%d/s", pacer->rate);
+  } else {
+    snprintf(target, sizeof(target), "unlimited");
+  }
+
+  printf("rate: target %s, achieved %.1f/s (%ld keystrokes in %.3fms, burst %d)\n",
+    target, achieved, pacer->keystrokeCount, elapsedNanos / 1e6, pacer->burst);
+}
+
+//prints an error and returns false if keyCmdStr contains an unknown modifier
+bool extractKeyCmd(const char* keyCmdStr, KeyCmd* keyCmd) {
+
+  int len = strlen(keyCmdStr);
+  int start = 0;
+  for (int i=0; i<len; i++) {
+    if (keyCmdStr[i] == '+') {
+      char modName[i-start+1];
+      memcpy(modName, &keyCmdStr[start], i-start);
+      modName[i-start] = '\0';
+
+      if (strcasecmp(modName, "ctrl") == 0){
+        keyCmd->ctrl = true;
+      } else if (strcasecmp(modName, "alt") == 0){
+        keyCmd->alt = true;
+      } else if (strcasecmp(modName, "super") == 0){
+        keyCmd->super = true;
+      } else if (strcasecmp(modName, "shift") == 0){
+        keyCmd->forceShift = true;
+      } else {
+        printf("ERROR: unknown modified %s\n", modName);
+        return false;
+      }
+      start = i+1;
+    }
+  }
+
+  keyCmd->keyName = strdup(&keyCmdStr[start]);
+  return true;
+}
+
+//the events to press and/or release the key in keyCmd, as a single keystroke
+//  modifiers are pressed before the key, and released after it
+//prints an error and returns false if the key name is unknown
+bool compileKeyCmd(KeyCmd keyCmd, bool press, bool release, TypePlan* plan) {
+  int keyCode;
+  bool shift = false;
+
+  if(!lookupKeyName(keyCmd.keyName, &keyCode, &shift)){
+    printf("ERROR: unknown key name %s\n", keyCmd.keyName);
+    return false;
+  }
+
+  if(press){
+    if(keyCmd.ctrl){
+      planKeyEvent(plan, KEY_LEFTCTRL, true);
+    }
+    if(keyCmd.alt){
+      planKeyEvent(plan, KEY_LEFTALT, true);
+    }
+    if(keyCmd.super){
+      planKeyEvent(plan, KEY_LEFTMETA, true); //they use meta for super instead of meta?
+    }
+    if(shift || keyCmd.forceShift){
+      planKeyEvent(plan, KEY_LEFTSHIFT, true);
+    }
+
+    planKeyEvent(plan, keyCode, true);
+  }
+
+  if(release){
+    planKeyEvent(plan, keyCode, false);
+
+    if(shift || keyCmd.forceShift){
+      planKeyEvent(plan, KEY_LEFTSHIFT, false);
+    }
+    if(keyCmd.super){
+      planKeyEvent(plan, KEY_LEFTMETA, false);
+    }
+    if(keyCmd.alt){
+      planKeyEvent(plan, KEY_LEFTALT, false);
+    }
+    if(keyCmd.ctrl){
+      planKeyEvent(plan, KEY_LEFTCTRL, false);
+    }
+  }
+  plan->keystrokeEnds.push_back(plan->events.size());
+  return true;
+}
+
+//runs one command per line as it is read, so it works on unbounded pipes
+//  stops at the first failing line, and returns false
+bool runScript(EventBuffer* evBuf, FILE* file) {
+  char* line = NULL;
+  size_t lineCap = 0;
+  long lineNum = 0;
+  bool ok = true;
+  while (ok && getline(&line, &lineCap, file) >= 0) {
+    lineNum++;
+    ok = runScriptLine(evBuf, line);
+    if (!ok) {
+      printf("ERROR: script failed at line %ld\n", lineNum);
+    }
+  }
+  free(line);
+  return ok;
+}
+
+bool runScriptLine(EventBuffer* evBuf, char* line) {
+  char* cmd;
+  char* arg;
+  if (!splitScriptLine(line, &cmd, &arg)) {
+    return true;
+  }
+  return runCommand(evBuf, cmd, arg);
+}
+
+//CMD ARG, split in place at the first space
+//  the ARG of 'type' is everything after that one space, with \n, \t and \\ unescaped
+//returns false for empty lines and lines starting with '#', which are skipped
+bool splitScriptLine(char* line, char** cmd, char** arg) {
+  size_t len = strlen(line);
+  if (len > 0 && line[len-1] == '\n') {
+    line[--len] = '\0';
+  }
+  if (len == 0 || line[0] == '#') {
+    return false;
+  }
+
+  *cmd = line;
+  *arg = strchr(line, ' ');
+  if (*arg == NULL) {
+    *arg = line + len;
+  } else {
+    *(*arg)++ = '\0';
+  }
+
+  if (strcmp(*cmd, "type") == 0) {
+    *arg = unescape(*arg);
+  } else {
+    while (**arg == ' ') {
+      (*arg)++;
+    }
+  }
+  return true;
+}
+
+//in place, replaces \n with newline, \t with tab and \\ with backslash
+char* unescape(char* str) {
+  char* out = str;
+  for (char* in = str; *in; in++) {
+    if (in[0] == '\\' && in[1] == 'n') {
+      *out++ = '\n';
+      in++;
+    } else if (in[0] == '\\' && in[1] == 't') {
+      *out++ = '\t';
+      in++;
+    } else if (in[0] == '\\' && in[1] == '\\') {
+      *out++ = '\\';
+      in++;
+    } else {
+      *out++ = *in;
+    }
+  }
+  *out = '\0';
+  return str;
+}
+
+//the hand-written names, which take precedence over generated names that are the same
+//  (e.g.: 'leftbrace' types '{', not '['), and which --keys named advertises
+constexpr KeyName WRITTEN_KEY_NAMES[] = {
+  {"enter",             KEY_ENTER,         false},
+  {"escape",            KEY_ESC,           false},
+  {"tab",               KEY_TAB,           false},
+  {"capslock",          KEY_CAPSLOCK,      false},
+  {"f1",                KEY_F1,            false},
+  {"f2",                KEY_F2,            false},
+  {"f3",                KEY_F3,            false},
+  {"f4",                KEY_F4,            false},
+  {"f5",                KEY_F5,            false},
+  {"f6",                KEY_F6,            false},
+  {"f7",                KEY_F7,            false},
+  {"f8",                KEY_F8,            false},
+  {"f9",                KEY_F9,            false},
+  {"f10",               KEY_F10,           false},
+  {"f11",               KEY_F11,           false},
+  {"f12",               KEY_F12,           false},
+  {"pageup",            KEY_PAGEUP,        false},
+  {"pagedown",          KEY_PAGEDOWN,      false},
+  {"home",              KEY_HOME,          false},
+  {"end",               KEY_END,           false},
+  {"insert",            KEY_INSERT,        false},
+  {"delete",            KEY_DELETE,        false},
+  {"left",              KEY_LEFT,          false},
+  {"right",             KEY_RIGHT,         false},
+  {"up",                KEY_UP,            false},
+  {"down",              KEY_DOWN,          false},
+  {"backspace",         KEY_BACKSPACE,     false},
+  {"space",             KEY_SPACE,         false},
+  {"bang",              KEY_1,             true},
+  {"doublequote",       KEY_APOSTROPHE,    true},
+  {"hash",              KEY_3,             true},
+  {"dollar",            KEY_4,             true},
+  {"percent",           KEY_5,             true},
+  {"ampersand",         KEY_7,             true},
+  {"apostrophe",        KEY_APOSTROPHE,    false},
+  {"leftparens",        KEY_9,             true},
+  {"rightparens",       KEY_0,             true},
+  {"asterisk",          KEY_8,             true},
+  {"plus",              KEY_EQUAL,         true},
+  {"comma",             KEY_COMMA,         false},
+  {"dash",              KEY_MINUS,         false},
+  {"period",            KEY_DOT,           false},
+  {"slash",             KEY_SLASH,         false},
+  {"0",                 KEY_0,             false},
+  {"1",                 KEY_1,             false},
+  {"2",                 KEY_2,             false},
+  {"3",                 KEY_3,             false},
+  {"4",                 KEY_4,             false},
+  {"5",                 KEY_5,             false},
+  {"6",                 KEY_6,             false},
+  {"7",                 KEY_7,             false},
+  {"8",                 KEY_8,             false},
+  {"9",                 KEY_9,             false},
+  {"colon",             KEY_SEMICOLON,     true},
+  {"semicolon",         KEY_SEMICOLON,     false},
+  {"less",              KEY_COMMA,         true},
+  {"equal",             KEY_EQUAL,         false},
+  {"greater",           KEY_DOT,           true},
+  {"question",          KEY_SLASH,         true},
+  {"at",                KEY_2,             true},
+  {"A",                 KEY_A,             true},
+  {"B",                 KEY_B,             true},
+  {"C",                 KEY_C,             true},
+  {"D",                 KEY_D,             true},
+  {"E",                 KEY_E,             true},
+  {"F",                 KEY_F,             true},
+  {"G",                 KEY_G,             true},
+  {"H",                 KEY_H,             true},
+  {"I",                 KEY_I,             true},
+  {"J",                 KEY_J,             true},
+  {"K",                 KEY_K,             true},
+  {"L",                 KEY_L,             true},
+  {"M",                 KEY_M,             true},
+  {"N",                 KEY_N,             true},
+  {"O",                 KEY_O,             true},
+  {"P",                 KEY_P,             true},
+  {"Q",                 KEY_Q,             true},
+  {"R",                 KEY_R,             true},
+  {"S",                 KEY_S,             true},
+  {"T",                 KEY_T,             true},
+  {"U",                 KEY_U,             true},
+  {"V",                 KEY_V,             true},
+  {"W",                 KEY_W,             true},
+  {"X",                 KEY_X,             true},
+  {"Y",                 KEY_Y,             true},
+  {"Z",                 KEY_Z,             true},
+  {"leftbracket",       KEY_LEFTBRACE,     false},
+  {"backslash",         KEY_BACKSLASH,     false},
+  {"rightbracket",      KEY_RIGHTBRACE,    false},
+  {"caret",             KEY_6,             true},
+  {"underscore",        KEY_MINUS,         true},
+  {"grave",             KEY_GRAVE,         false},
+  {"a",                 KEY_A,             false},
+  {"b",                 KEY_B,             false},
+  {"c",                 KEY_C,             false},
+  {"d",                 KEY_D,             false},
+  {"e",                 KEY_E,             false},
+  {"f",                 KEY_F,             false},
+  {"g",                 KEY_G,             false},
+  {"h",                 KEY_H,             false},
+  {"i",                 KEY_I,             false},
+  {"j",                 KEY_J,             false},
+  {"k",                 KEY_K,             false},
+  {"l",                 KEY_L,             false},
+  {"m",                 KEY_M,             false},
+  {"n",                 KEY_N,             false},
+  {"o",                 KEY_O,             false},
+  {"p",                 KEY_P,             false},
+  {"q",                 KEY_Q,             false},
+  {"r",                 KEY_R,             false},
+  {"s",                 KEY_S,             false},
+  {"t",                 KEY_T,             false},
+  {"u",                 KEY_U,             false},
+  {"v",                 KEY_V,             false},
+  {"w",                 KEY_W,             false},
+  {"x",                 KEY_X,             false},
+  {"y",                 KEY_Y,             false},
+  {"z",                 KEY_Z,             false},
+  {"leftbrace",         KEY_LEFTBRACE,     true},
+  {"pipe",              KEY_BACKSLASH,     true},
+  {"rightbrace",        KEY_RIGHTBRACE,    true},
+  {"tilde",             KEY_GRAVE,         true},
+};
+constexpr int WRITTEN_KEY_NAME_COUNT = sizeof(WRITTEN_KEY_NAMES) / sizeof(WRITTEN_KEY_NAMES[0]);
+
+//every KEY_* and BTN_* name, advertised only by --keys all (or exact, when a script names them)
+constexpr KeyName GENERATED_KEY_NAMES[] = {
+#include "keycodes.inc"
+};
+constexpr int KEY_NAME_COUNT = WRITTEN_KEY_NAME_COUNT
+  + sizeof(GENERATED_KEY_NAMES) / sizeof(GENERATED_KEY_NAMES[0]);
+
+//both in one table, hand-written names first, so that the hash indexes a single array
+struct KeyNameTable {
+  KeyName names[KEY_NAME_COUNT];
+};
+
+constexpr KeyNameTable joinKeyNames() {
+  KeyNameTable table = {};
+  for (int i = 0; i < KEY_NAME_COUNT; i++) {
+    table.names[i] = i < WRITTEN_KEY_NAME_COUNT
+      ? WRITTEN_KEY_NAMES[i] : GENERATED_KEY_NAMES[i - WRITTEN_KEY_NAME_COUNT];
+  }
+  return table;
+}
+constexpr KeyNameTable KEY_NAME_TABLE = joinKeyNames();
+constexpr const KeyName* KEY_NAMES = KEY_NAME_TABLE.names;
+
+//a perfect hash of KEY_NAMES, built at compile time with hash-and-displace:
+//  a name's bucket is hashKeyName(name, 0), and each bucket has a seed
+//  that moves all of its names into free slots with hashKeyName(name, seed)
+#define KEY_HASH_BUCKETS 512
+#define KEY_HASH_SLOTS 2048
+#define KEY_HASH_MAX_SEED 65535
+struct KeyNameHash {
+  bool ok;
+  unsigned short seeds[KEY_HASH_BUCKETS];
+  short slots[KEY_HASH_SLOTS]; //index into KEY_NAMES, or -1
+};
+
+//FNV-1a, case-insensitive for all names except single letters
+constexpr uint32_t hashKeyName(const char* name, uint32_t seed) {
+  bool fold = name[0] != '\0' && name[1] != '\0';
+  uint32_t h = 2166136261u ^ (seed * 0x9e3779b9u);
+  for (int i = 0; name[i] != '\0'; i++) {
+    char c = name[i];
+    if (fold && c >= 'A' && c <= 'Z') {
+      c += 'a' - 'A';
+    }
+    h = (h ^ (unsigned char)c) * 16777619u;
+  }
+  return h ^ (h >> 15);
+}
+
+//the same comparison hashKeyName() implies: names in KEY_NAMES are lowercase
+constexpr bool keyNameEquals(const char* name, const char* tableName) {
+  bool fold = name[0] != '\0' && name[1] != '\0';
+  int i = 0;
+  for (; name[i] != '\0' && tableName[i] != '\0'; i++) {
+    char c = name[i];
+    if (fold && c >= 'A' && c <= 'Z') {
+      c += 'a' - 'A';
+    }
+    if (c != tableName[i]) {
+      return false;
+    }
+  }
+  return name[i] == tableName[i];
+}
+
+//ok is false if some bucket cannot be placed without a collision
+constexpr KeyNameHash buildKeyNameHash() {
+  KeyNameHash table = {};
+  table.ok = true;
+  for (int i = 0; i < KEY_HASH_SLOTS; i++) {
+    table.slots[i] = -1;
+  }
+
+  //names grouped by bucket: bucket b is members[bucketStarts[b]...bucketEnds[b]-1]
+  short buckets[KEY_NAME_COUNT] = {};
+  short members[KEY_NAME_COUNT] = {};
+  int bucketStarts[KEY_HASH_BUCKETS] = {};
+  int bucketEnds[KEY_HASH_BUCKETS] = {};
+  for (int i = 0; i < KEY_NAME_COUNT; i++) {
+    buckets[i] = hashKeyName(KEY_NAMES[i].name, 0) % KEY_HASH_BUCKETS;
+    bucketEnds[buckets[i]]++;
+  }
+  for (int b = 1; b < KEY_HASH_BUCKETS; b++) {
+    bucketStarts[b] = bucketEnds[b-1];
+    bucketEnds[b] += bucketEnds[b-1];
+  }
+  for (int b = 0; b < KEY_HASH_BUCKETS; b++) {
+    bucketEnds[b] = bucketStarts[b];
+  }
+  for (int i = 0; i < KEY_NAME_COUNT; i++) {
+    members[bucketEnds[buckets[i]]++] = i;
+  }
+
+  //later duplicates of a name are left out of their bucket
+  int bucketSizes[KEY_HASH_BUCKETS] = {};
+  int maxBucketSize = 0;
+  for (int b = 0; b < KEY_HASH_BUCKETS; b++) {
+    int end = bucketStarts[b];
+    for (int m = bucketStarts[b]; m < bucketEnds[b]; m++) {
+      bool dup = false;
+      for (int n = bucketStarts[b]; n < end && !dup; n++) {
+        dup = keyNameEquals(KEY_NAMES[members[m]].name, KEY_NAMES[members[n]].name);
+      }
+      if (!dup) {
+        members[end++] = members[m];
+      }
+    }
+    bucketEnds[b] = end;
+    bucketSizes[b] = end - bucketStarts[b];
+    maxBucketSize = bucketSizes[b] > maxBucketSize ? bucketSizes[b] : maxBucketSize;
+  }
+
+  //largest buckets first, while the slots are emptiest
+  for (int size = maxBucketSize; size > 0; size--) {
+    for (int b = 0; b < KEY_HASH_BUCKETS; b++) {
+      if (bucketSizes[b] != size) {
+        continue;
+      }
+      bool placed = false;
+      for (int seed = 1; seed <= KEY_HASH_MAX_SEED && !placed; seed++) {
+        int m = bucketStarts[b];
+        for (; m < bucketEnds[b]; m++) {
+          int slot = hashKeyName(KEY_NAMES[members[m]].name, seed) % KEY_HASH_SLOTS;
+          if (table.slots[slot] >= 0) {
+            break;
+          }
+          table.slots[slot] = members[m];
+        }
+        placed = m == bucketEnds[b];
+        if (placed) {
+          table.seeds[b] = seed;
+        }
+        //undo a partial placement
+        while (!placed && m-- > bucketStarts[b]) {
+          table.slots[hashKeyName(KEY_NAMES[members[m]].name, seed) % KEY_HASH_SLOTS] = -1;
+        }
+      }
+      table.ok = table.ok && placed;
+    }
+  }
+  return table;
+}
+
+constexpr KeyNameHash KEY_NAME_HASH = buildKeyNameHash();
+static_assert(KEY_NAME_COUNT < 32768, "too many key names for KeyNameHash.slots");
+static_assert(KEY_NAME_HASH.ok, "key name hash collision, change KEY_HASH_BUCKETS or KEY_HASH_SLOTS");
+
+//returns false if keyName is unknown
+//  names longer than one character are case-insensitive
+//  'keycode:NNN' is the raw keycode NNN
+bool lookupKeyName(const char* keyName, int* keyCode, bool* shift) {
+  if (strncasecmp(keyName, "keycode:", 8) == 0) {
+    const char* digits = keyName + 8;
+    char* end;
+    long code = strtol(digits, &end, 10);
+    if (!isdigit(digits[0]) || *end != '\0' || code <= 0 || code >= KEY_CNT) {
+      return false;
+    }
+    *keyCode = code;
+    *shift = false;
+    return true;
+  }
+
+  uint32_t bucket = hashKeyName(keyName, 0) % KEY_HASH_BUCKETS;
+  uint32_t slot = hashKeyName(keyName, KEY_NAME_HASH.seeds[bucket]) % KEY_HASH_SLOTS;
+  int i = KEY_NAME_HASH.slots[slot];
+  if (i < 0 || !keyNameEquals(keyName, KEY_NAMES[i].name)) {
+    return false;
+  }
+  *keyCode = KEY_NAMES[i].keyCode;
+  *shift = KEY_NAMES[i].shift;
+  return true;
+}
+
+//keys every device advertises, whatever it will send:
+//  ESC, digits and Q-D (1-31) make udev tag it ID_INPUT_KEYBOARD,
+//  and the modifiers are released at the start of every typed string
+void addBaseKeys(KeySet* keys) {
+  for (int i = KEY_ESC; i <= KEY_D; i++) {
+    keys->set(i);
+  }
+  for (int i = 0; i < MOD_KEY_COUNT; i++) {
+    keys->set(MOD_KEYS[i][1]);
+  }
+}
+
+//the buttons of the POINTER_* types in pointerTypes
+void addPointerKeys(KeySet* keys, int pointerTypes) {
+  if (pointerTypes & POINTER_MOUSE) {
+    keys->set(BTN_LEFT);
+    keys->set(BTN_RIGHT);
+    keys->set(BTN_MIDDLE);
+  }
+  if (pointerTypes & POINTER_TOUCH) {
+    keys->set(BTN_TOUCH);
+  }
+}
+
+//the hand-written key names, and every key that can be typed
+//  generated names are left out, to keep the device close to a plain keyboard
+//  (they are advertised when a single key command, or --keys exact, names them)
+void addNamedKeys(KeySet* keys, const Layout* layout) {
+  addBaseKeys(keys);
+  for (int i = 0; i < WRITTEN_KEY_NAME_COUNT; i++) {
+    keys->set(WRITTEN_KEY_NAMES[i].keyCode);
+  }
+  addTypeableKeys(keys, layout);
+}
+
+//every KEY_* name, and every key that can be typed
+//  buttons are left out, so that the device still looks like a keyboard
+void addAllKeys(KeySet* keys, const Layout* layout) {
+  addBaseKeys(keys);
+  for (int i = 0; i < KEY_NAME_COUNT; i++) {
+    if (strncmp(KEY_NAMES[i].name, "btn_", 4) != 0) {
+      keys->set(KEY_NAMES[i].keyCode);
+    }
+  }
+  addTypeableKeys(keys, layout);
+}
+
+//the keys of every character in layout (or the built-in us one), and its dead keys
+void addTypeableKeys(KeySet* keys, const Layout* layout) {
+  if (layout->header == NULL) {
+    for (int i = 0; i < 256; i++) {
+      keys->set(CHAR_KEYS.keys[i].keyCode);
+    }
+  } else {
+    for (uint32_t i = 0; i < layout->header->deadKeyCount; i++) {
+      keys->set(layout->deadKeys[i].keyCode);
+    }
+    for (uint32_t i = 0; i < layout->header->pageCount * 256; i++) {
+      keys->set(layout->pages[i].keyCode);
+    }
+  }
+  keys->reset(KEY_RESERVED);
+}
+
+void addLegacyKeys(KeySet* keys) {
+  for (int i = 0; i < 256; i++) {
+    keys->set(i);
+  }
+}
+
+//the keys the events of plan press and release
+void addCommandKeys(KeySet* keys, const CommandPlan* plan) {
+  addBaseKeys(keys);
+  for (const struct input_event& evt : plan->events) {
+    if (evt.type == EV_KEY) {
+      keys->set(evt.code);
+    }
+  }
+}
+
+//maps the records of a log read-only, after checking the header
+bool mapLog(const char* logPath, const LogRecord** records, size_t* recordCount, size_t* mapSize) {
+  int fd = open(logPath, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    printf("ERROR: could not open %s (%s)\n", logPath, strerror(errno));
+    return false;
+  }
+
+  struct stat st;
+  const char* data = (const char*)MAP_FAILED;
+  if (fstat(fd, &st) == 0 && st.st_size >= (off_t)sizeof(LogHeader)) {
+    data = (const char*)mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  }
+  close(fd);
+
+  const LogHeader* header = (const LogHeader*)data;
+  if (data == MAP_FAILED
+    || memcmp(header->magic, LOG_MAGIC, sizeof(header->magic)) != 0
+    || header->recordSize != sizeof(LogRecord)
+  ) {
+    printf("ERROR: %s is not a udotool log\n", logPath);
+    if (data != MAP_FAILED) {
+      munmap((void*)data, st.st_size);
+    }
+    return false;
+  }
+
+  madvise((void*)data, st.st_size, MADV_SEQUENTIAL);
+
+  *records = (const LogRecord*)(data + sizeof(LogHeader));
+  *recordCount = (st.st_size - sizeof(LogHeader)) / sizeof(LogRecord);
+  *mapSize = st.st_size;
+  return true;
+}
+
+void addLogKeys(KeySet* keys, const LogRecord* records, size_t recordCount) {
+  addBaseKeys(keys);
+  for (size_t i = 0; i < recordCount; i++) {
+    if (records[i].type == EV_KEY && records[i].code < KEY_CNT) {
+      keys->set(records[i].code);
+    }
+  }
+}
+
+//the pointer types whose events are in the log: EV_REL for a mouse, EV_ABS for touch
+int logPointerTypes(const LogRecord* records, size_t recordCount) {
+  int pointerTypes = 0;
+  for (size_t i = 0; i < recordCount; i++) {
+    if (records[i].type == EV_REL) {
+      pointerTypes |= POINTER_MOUSE;
+    } else if (records[i].type == EV_ABS) {
+      pointerTypes |= POINTER_TOUCH;
+    }
+  }
+  return pointerTypes;
+}
+
+//whether the device of sink reports the event, and so the kernel would pass it on
+bool sinkReportsEvent(const EventSink* sink, int type, int code) {
+  switch (type) {
+    case EV_SYN:
+      return true;
+    case EV_KEY:
+      return code < KEY_CNT && sink->keys.test(code);
+    case EV_REL:
+      return (sink->pointerTypes & POINTER_MOUSE) && (code == REL_X || code == REL_Y);
+    case EV_ABS:
+      if (sink->pointerTypes & POINTER_TOUCH) {
+        for (int axis : TOUCH_AXES) {
+          if (code == axis) {
+            return true;
+          }
+        }
+      }
+      return false;
+  }
+  return false;
+}
+
+//each record's deadline is the start plus all deltas so far, divided by speed,
+//  so sleeps never accumulate drift; events sharing a deadline go out in one write
+//events the device does not report are skipped, and so is the SYN_REPORT of a frame
+//  that had only those, e.g.: a mousemove on a device without a mouse
+bool replayLog(EventBuffer* evBuf, const LogRecord* records, size_t recordCount, double speed) {
+  long long startNanos = nowNanos();
+  long long offsetMicros = 0;
+  long skipped = 0;
+  bool frameReplayed = false;
+  bool frameSkipped = false;
+  bool ok = true;
+  for (size_t i = 0; i < recordCount; i++) {
+    const LogRecord* record = &records[i];
+    offsetMicros += record->deltaMicros;
+
+    if (record->type == EV_SYN && record->code == SYN_REPORT) {
+      bool emptyFrame = frameSkipped && !frameReplayed;
+      frameReplayed = false;
+      frameSkipped = false;
+      if (emptyFrame) {
+        continue;
+      }
+    } else if (!sinkReportsEvent(&evBuf->sink, record->type, record->code)) {
+      skipped++;
+      frameSkipped = true;
+      continue;
+    } else {
+      frameReplayed = true;
+    }
+
+    if (speed > 0 && record->deltaMicros > 0) {
+      long long deadline = startNanos + (long long)(offsetMicros * 1000.0 / speed);
+      if (deadline > nowNanos()) {
+        ok = flushEvents(evBuf) && ok;
+        sleepUntil(deadline);
+      }
+    }
+    ok = queueEvent(evBuf, record->type, record->code, record->value) && ok;
+  }
+  ok = flushEvents(evBuf) && ok;
+
+  if (skipped > 0) {
+    printf("WARNING: skipped %ld events the device does not report\n", skipped);
+  }
+  return ok;
+}
+
+//the configuration is the session's own, and its EventBuffer points to it,
+//  so sessions share nothing that changes
+struct SessionState {
+  Config config;
+  EventBuffer evBuf;
+  bool opened = false;
+};
+
+Session::Session(const SessionOptions& options) : state(new SessionState()) {
+  state->config.options = options;
+}
+
+Session::~Session() {
+  close();
+  if (state) {
+    unloadLayout(&state->config.layout);
+  }
+}
+
+Session::Session(Session&& other) noexcept : state(std::move(other.state)) {
+}
+
+Session& Session::operator=(Session&& other) noexcept {
+  if (this != &other) {
+    close();
+    if (state) {
+      unloadLayout(&state->config.layout);
+    }
+    state = std::move(other.state);
+  }
+  return *this;
+}
+
+SessionOptions& Session::options() {
+  return state->config.options;
+}
+
+//closes the sink first, if it is already open
+bool Session::open(const KeySet* keys, int sinkType, const char* path) {
+  close();
+  Config* config = &state->config;
+  unloadLayout(&config->layout);
+  if (config->options.layout != NULL && !loadLayout(config->options.layout, &config->layout)) {
+    return false;
+  }
+
+  KeySet namedKeys;
+  if (keys == NULL) {
+    addNamedKeys(&namedKeys, &config->layout);
+    keys = &namedKeys;
+  }
+  state->evBuf = EventBuffer();
+  state->evBuf.config = config;
+  state->opened = openSink(&state->evBuf.sink, sinkType, path, keys, config);
+  return state->opened;
+}
+
+//writes anything still queued, and destroys the device
+void Session::close() {
+  if (isOpen()) {
+    flushEvents(&state->evBuf);
+    closeSink(&state->evBuf.sink, &state->config);
+    state->opened = false;
+  }
+}
+
+bool Session::isOpen() const {
+  return state && state->opened;
+}
+
+const char* Session::devPath() const {
+  return state ? state->evBuf.sink.devPath : "";
+}
+
+long Session::droppedEvents() const {
+  return state ? state->evBuf.droppedEventCount : 0;
+}
+
+bool Session::type(std::string_view str) {
+  if (!isOpen()) {
+    printf("ERROR: session is not open\n");
+    return false;
+  }
+  std::string typeStr(str);
+  return runCommand(&state->evBuf, "type", typeStr.c_str());
+}
+
+bool Session::key(const char* keys) {
+  return command("key", keys);
+}
+
+bool Session::keyDown(const char* keys) {
+  return command("keydown", keys);
+}
+
+bool Session::keyUp(const char* keys) {
+  return command("keyup", keys);
+}
+
+bool Session::command(const char* cmd, const char* arg) {
+  if (!isOpen()) {
+    printf("ERROR: session is not open\n");
+    return false;
+  }
+  return runCommand(&state->evBuf, cmd, arg);
+}
+
+//does nothing if the session is not open
+void Session::event(int type, int code, int value) {
+  if (isOpen()) {
+    queueEvent(&state->evBuf, type, code, value);
+  }
+}
+
+bool Session::sync() {
+  event(EV_SYN, SYN_REPORT, 0);
+  return flush();
+}
+
+bool Session::flush() {
+  if (!isOpen()) {
+    return false;
+  }
+  return flushEvents(&state->evBuf);
+}
@@ -1,40 +1,119 @@
-#include <cstdio>
 #include <cstring>
-#include <ctype.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
+#include <sys/un.h>
 
-#include <linux/uinput.h>
+#include "udotool_internal.h"
 
-struct KeyCmd {
-  char* keyName;
-  bool ctrl = false;
-  bool alt = false;
-  bool super = false;
-  bool forceShift = false;
+//the fds of a DeviceStream that runDevices watches
+enum {
+  WATCH_TIMER,  //deadlines of frames and sleeps, and the write timeout
+  WATCH_INPUT,  //the script, when it is a pipe with nothing to read yet
+  WATCH_OUTPUT, //the sink, after it reported EAGAIN
+  WATCH_COUNT,
 };
 
-constexpr u_int64_t hash(const char* s, size_t index = 0);
+//one device and the script running on it, in runDevices
+//  each command is compiled into frames of events when the previous one has been written,
+//  and each frame is written when its deadline passes
+struct DeviceStream {
+  int index; //1-based, as in the device name
+  Config config; //a copy of CONFIG, so that a 'rate' only changes this device
+  EventBuffer evBuf;
+  Pacer pacer; //the stream's rate and burst, and its keystrokes so far, for --report-rate
 
-void emitKeyEvent(int uinputFD, int keyCode, bool pressed);
-void writeEvent(int uinputFD, int type, int code, int val);
-void typeString(int uinputFD, const char* str);
-void typeChar(int uinputFD, char c);
-KeyCmd extractKeyCmd(const char* keyCmdStr);
-void pressKeyCmd(int uinputFD, KeyCmd keyCmd);
-char* toLower(char* str);
+  const char* scriptPath;
+  int scriptFD = -1;
+  int savedFlags = -1; //of a pipe, before O_NONBLOCK was set
+  std::string input;   //read, and not yet run from inputPos
+  size_t inputPos = 0;
+  long lineNum = 0;
+  bool inputEnded = false;
+  bool inputWatched = false;
 
-int DEVICE_INIT_DELAY_MILLIS = 200;
-int KEYSTROKE_DELAY_MILLIS = 10;
+  int timerFD = -1;
+  std::vector<struct input_event> events; //of the current command
+  std::vector<size_t> frameEnds;
+  std::vector<long long> frameDeadlines;
+  size_t frame = 0;        //the next frame that is not yet due
+  size_t writeEnd = 0;     //events that are due
+  size_t writtenBytes = 0; //of events
+  long long blockedNanos = 0;   //when the sink reported EAGAIN, or 0
+  long long notBeforeNanos = 0; //the end of a sleep
+
+  bool done = false;
+  bool failed = false;
+};
+
+bool addScriptKeys(KeySet* keys, FILE* file);
+void printStats();
+const char* getSocketPath();
+void runDaemon(EventBuffer* evBuf, const char* socketPath);
+bool checkRequestSleep(const char* arg);
+int runClient(const char* socketPath, const char* cmd, const char* arg);
+void onStopSignal(int sig);
+void handleStopSignals();
+int parseIntArg(const char* optName, const char* value);
+int runRecord(const char* devPath, const char* logPath);
+int runBench(long keystrokes);
+bool benchPipeline(long keystrokes);
+void benchLoopback(int iterations);
+int runDevices(int deviceCount, const char* const* paths, int pathCount);
+void advanceStream(DeviceStream* stream, int epollFD);
+bool planStreamCommand(DeviceStream* stream, const char* cmd, const char* arg, long long now);
+bool readStreamLine(DeviceStream* stream, int epollFD, std::string* line);
+void writeStreamEvents(DeviceStream* stream, int epollFD);
+void dropStreamEvents(DeviceStream* stream);
+bool watchStream(int epollFD, DeviceStream* stream, int fd, int watch, uint32_t events);
+void armTimer(int timerFD, long long deadlineNanos);
+
+//the configuration of every device, set from OPTS
+Config CONFIG;
+bool POINTER_AUTO = true; //the pointer types of CONFIG follow the command(s), unless --pointer is given
+
+Stats STATS;
+
+int OUTPUT_TYPE = SINK_UINPUT;
+const char* OUTPUT_PATH = NULL;
+
+double REPLAY_SPEED = 1.0;
+
+long BENCH_KEYSTROKES = 1000000;
+int BENCH_RUNS = 5;
+int BENCH_LOOPBACK_ITERATIONS = 1000;
+
+int STATS_MODE = STATS_OFF;
+
+int KEY_SET_MODE = KEYS_AUTO;
+
+int DEVICE_COUNT = 0; //0 for one device per script FILE
+int DEVICE_TURN_STEPS = 64; //frames, chunks and commands a stream runs before letting others run
+
+//in a root-owned directory, so no other user can bind it first and receive what clients type
+const char* DEFAULT_SOCKET_PATH = "/run/udotool.socket";
+int DEFAULT_SOCKET_MODE = 0600;
+int MAX_REQUEST_SIZE = 1024 * 1024;
+long MAX_REQUEST_SLEEP_MILLIS = 10000; //so that one client cannot stall the daemon for the others
+int REQUEST_TIMEOUT_MILLIS = 1000; //for a client to send its whole request, so an idle one cannot block the rest
+
+volatile sig_atomic_t running = 1;
 
 const char* USAGE =
   "Usage:\n"
-  "  %1$s STRING_TO_TYPE\n"
-  "  %1$s type STRING_TO_TYPE\n"
+  "  %1$s [OPTS] STRING_TO_TYPE\n"
+  "  %1$s [OPTS] type STRING_TO_TYPE\n"
   "    emit key events for every character in STRING_TO_TYPE\n"
   "\n"
-  "  %1$s key [MODS]KEY_NAME\n"
+  "  %1$s [OPTS] key [MODS]KEY_NAME\n"
   "    emit KEY_CODE for KEY_NAME, after pressing any MODS,\n"
   "      including implicit shift\n"
   "\n"
@@ -52,394 +131,1276 @@ const char* USAGE =
   "\n"
   "KEY_NAME\n"
   "  e.g.: 'enter', 'home', 'x', 'q'\n"
+  "  or any KEY_* in linux/input-event-codes.h, without KEY_, e.g.: 'kpenter', 'f24', 'mute'\n"
+  "  or any BTN_* in linux/input-event-codes.h, e.g.: 'btn_left'\n"
+  "  or 'keycode:NNN' for the raw keycode NNN, e.g.: 'keycode:28'\n"
+  "  names longer than one character are case-insensitive\n"
+  "\n"
+  "  %1$s [OPTS] script [FILE | -]\n"
+  "    read commands from FILE (or stdin) and run each line as it arrives,\n"
+  "      all on one uinput device\n"
+  "    one command per line, empty lines and lines starting with '#' are ignored:\n"
+  "      type STRING_TO_TYPE   (\\n, \\t and \\\\ are unescaped)\n"
+  "      key [MODS]KEY_NAME\n"
+  "      keydown [MODS]KEY_NAME  (press MODS and KEY_NAME, without releasing)\n"
+  "      keyup [MODS]KEY_NAME    (release KEY_NAME and MODS)\n"
+  "      sleep MILLIS\n"
+  "      rate KEYSTROKES_PER_SECOND\n"
+  "      mousemove, click, tap, swipe  (like the commands below)\n"
+  "\n"
+  "  %1$s [OPTS] script FILE FILE...\n"
+  "  %1$s [OPTS] --devices N script FILE | FILE...\n"
+  "    create one uinput device per FILE (or N devices, for --devices N),\n"
+  "      named '... 1' to '... N', and run every FILE on its own device at the same time,\n"
+  "      from one process (one FILE runs on every device, if it is not a pipe)\n"
+  "    each device has its own pacing: --rate, 'rate' and 'sleep' apply to it alone,\n"
+  "      and a device that cannot be written to yet does not hold up the others\n"
+  "\n"
+  "  %1$s [OPTS] mousemove DX DY [MILLIS]\n"
+  "    move the mouse pointer by DX,DY, in steps at --frame-rate over MILLIS (default is 0)\n"
+  "  %1$s [OPTS] click [left | right | middle]\n"
+  "    press and release a mouse button (default is left)\n"
+  "  %1$s [OPTS] tap X Y\n"
+  "    touch the touchscreen at X,Y and lift, one frame later\n"
+  "  %1$s [OPTS] swipe X1 Y1 X2 Y2 [MILLIS]\n"
+  "    touch at X1,Y1, drag to X2,Y2 at --frame-rate over MILLIS (default is %5$ld), and lift\n"
+  "  the whole path is computed first, and each frame is one SYN_REPORT in one write()\n"
+  "  X,Y are in 0..WIDTH-1, 0..HEIGHT-1 of --touch-size\n"
+  "\n"
+  "  %1$s record DEVICE LOG_FILE\n"
+  "    read events from an evdev DEVICE (e.g.: /dev/input/event3) until SIGINT/SIGTERM,\n"
+  "      and write them to LOG_FILE with their relative timing, as 12-byte records\n"
+  "\n"
+  "  %1$s [OPTS] replay LOG_FILE\n"
+  "    re-emit the key and pointer events in LOG_FILE with their original timing (see --speed)\n"
+  "      events the device does not report are skipped (see --keys and --pointer)\n"
+  "    LOG_FILE is memory-mapped and streamed, so it can be any size\n"
+  "\n"
+  "  %1$s [OPTS] bench [KEYSTROKES]\n"
+  "    measure events/s and ns/keystroke of a script typing KEYSTROKES characters\n"
+  "      (default is %3$ld) through parsing, mapping and emitting to a null sink\n"
+  "    if /dev/uinput is writable, also measure the latency from write() to uinput\n"
+  "      until the event can be read back from its evdev node (grabbed, so nothing\n"
+  "      else sees the events)\n"
+  "\n"
+  "  %1$s [OPTS] daemon\n"
+  "    create the uinput device once, and then serve script commands\n"
+  "      from '%1$s client' over a unix socket until SIGINT/SIGTERM\n"
+  "\n"
+  "  %1$s client type STRING_TO_TYPE\n"
+  "  %1$s client key [MODS]KEY_NAME\n"
+  "  %1$s client CMD ARG\n"
+  "    send the command to a running '%1$s daemon' instead of creating a device\n"
+  "    CMD is any script command, and ARG is not unescaped\n"
+  "    'rate' only applies to its own request, and 'sleep' is limited to 10000 millis,\n"
+  "      so that one client cannot slow down or stall the daemon for the others\n"
+  "\n"
+  "OPTS\n"
+  "  --rate KEYSTROKES_PER_SECOND\n"
+  "    type at most this many characters per second, 0 for unlimited (default is 100)\n"
+  "    keystrokes are scheduled on absolute deadlines, so sleeps do not drift\n"
+  "  --burst KEYSTROKES\n"
+  "    send this many keystrokes together at each deadline (default is 1)\n"
+  "  --report-rate\n"
+  "    after typing, print the target rate and the achieved rate\n"
+  "  --trace\n"
+  "    print the time taken by each phase as it ends, and --stats at exit\n"
+  "  --stats\n"
+  "    at exit, print time per phase, events, write syscalls, bytes,\n"
+  "      p50/p99/max write() latency, and the effective keystroke rate\n"
+  "  --stats-json\n"
+  "    like --stats, formatted as one line of JSON\n"
+  "  --layout NAME | FILE\n"
+  "    type characters as they are on this keyboard layout (default is us)\n"
+  "    NAME is a layout compiled into %4$s/NAME.kbd (e.g.: de, fi, ru),\n"
+  "      and FILE is the path of one (see tools/compile-layout.py)\n"
+  "  --pointer auto | none | mouse | touch | both\n"
+  "    which pointer devices the device also acts as\n"
+  "    auto: whatever a single command, a replayed LOG_FILE, or a script FILE with --keys exact,\n"
+  "          needs (default)\n"
+  "    mouse: EV_REL motion and left/right/middle buttons\n"
+  "    touch: a direct (touchscreen) device, with multi-touch slots\n"
+  "  --frame-rate HZ\n"
+  "    motion frames per second, for mousemove and swipe (default is 120)\n"
+  "  --touch-size WIDTHxHEIGHT\n"
+  "    the range of touch coordinates, usually the screen resolution (default is 1080x1920)\n"
+  "  --speed MULTIPLIER\n"
+  "    replay at this multiple of the recorded speed, 0 for no delays (default is 1)\n"
+  "  --output uinput | null | record:FILE\n"
+  "    where events go (default is uinput)\n"
+  "    uinput:      a new uinput device\n"
+  "    null:        discard events without a syscall, e.g.: for benchmarks\n"
+  "    record:FILE  append binary 'struct input_event' records to FILE,\n"
+  "                   timestamped with CLOCK_MONOTONIC when they are written\n"
+  "  --devices N\n"
+  "    the number of devices for script FILEs (default is one per FILE)\n"
+  "    with --output record:FILE, device N records to FILE.N\n"
+  "  --keys auto | exact | named | all | legacy\n"
+  "    which keys the device advertises, always including ESC, digits, Q-D and MODS\n"
+  "    auto:   exactly the keys of a single type/key command,\n"
+  "              and the named keys for script and daemon (default)\n"
+  "    exact:  like auto, and exactly the keys a script FILE needs,\n"
+  "              found by reading and validating it before creating the device\n"
+  "    named:  every key that can be typed, and the hand-written KEY_NAMEs\n"
+  "              ('enter', 'home', 'f1', ...)\n"
+  "    all:    like named, and every KEY_* in linux/input-event-codes.h (not BTN_*)\n"
+  "    legacy: keycodes 0-255, like older versions\n"
+  "    a key command for a key the device does not advertise fails\n"
+  "\n"
+  "ENVIRONMENT\n"
+  "  UDOTOOL_LAYOUT\n"
+  "    like --layout\n"
+  "  UDOTOOL_SOCKET\n"
+  "    path of the daemon socket (default is %2$s)\n"
+  "    a daemon that does not run as root needs one in a directory it owns,\n"
+  "      e.g.: $XDG_RUNTIME_DIR/udotool.socket\n"
+  "  UDOTOOL_SOCKET_MODE\n"
+  "    octal permissions the daemon creates the socket with (default is 0600)\n"
 ;
 
 int main(int argc, char *argv[]){
-  const char* typeStr = NULL;
-  char* keyCmdStr = NULL;
+  const char* cmd = NULL; //a single command, as a script line would have it
+  std::string arg;
+  FILE* scriptFile = NULL;
+
+  const char* layoutName = getenv("UDOTOOL_LAYOUT");
+
+  STATS.lastMarkNanos = nowNanos();
+  CONFIG.stats = &STATS;
+
+  //consume leading OPTS, keeping argv[0] in place
+  while(argc > 1 && strncmp(argv[1], "--", 2) == 0 && strcmp(argv[1], "--help") != 0){
+    int optArgCount = 1;
+    if(strcmp(argv[1], "--rate") == 0 && argc > 2){
+      CONFIG.options.keystrokeRate = parseIntArg(argv[1], argv[2]);
+      optArgCount = 2;
+    }else if(strcmp(argv[1], "--burst") == 0 && argc > 2){
+      CONFIG.options.keystrokeBurst = parseIntArg(argv[1], argv[2]);
+      if(CONFIG.options.keystrokeBurst < 1){
+        printf("ERROR: --burst must be at least 1\n");
+        exit(1);
+      }
+      optArgCount = 2;
+    }else if(strcmp(argv[1], "--report-rate") == 0){
+      CONFIG.reportRate = true;
+    }else if(strcmp(argv[1], "--trace") == 0){
+      STATS.trace = true;
+      if(STATS_MODE == STATS_OFF){
+        STATS_MODE = STATS_TEXT;
+      }
+    }else if(strcmp(argv[1], "--stats") == 0){
+      STATS_MODE = STATS_TEXT;
+    }else if(strcmp(argv[1], "--stats-json") == 0){
+      STATS_MODE = STATS_JSON;
+    }else if(strcmp(argv[1], "--layout") == 0 && argc > 2){
+      layoutName = argv[2];
+      optArgCount = 2;
+    }else if(strcmp(argv[1], "--pointer") == 0 && argc > 2){
+      POINTER_AUTO = strcmp(argv[2], "auto") == 0;
+      if(POINTER_AUTO || strcmp(argv[2], "none") == 0){
+        CONFIG.options.pointerTypes = 0;
+      }else if(strcmp(argv[2], "mouse") == 0){
+        CONFIG.options.pointerTypes = POINTER_MOUSE;
+      }else if(strcmp(argv[2], "touch") == 0){
+        CONFIG.options.pointerTypes = POINTER_TOUCH;
+      }else if(strcmp(argv[2], "both") == 0){
+        CONFIG.options.pointerTypes = POINTER_MOUSE | POINTER_TOUCH;
+      }else{
+        printf("ERROR: invalid value for --pointer: %s\n", argv[2]);
+        exit(1);
+      }
+      optArgCount = 2;
+    }else if(strcmp(argv[1], "--frame-rate") == 0 && argc > 2){
+      CONFIG.options.frameRate = parseIntArg(argv[1], argv[2]);
+      if(CONFIG.options.frameRate < 1){
+        printf("ERROR: --frame-rate must be at least 1\n");
+        exit(1);
+      }
+      optArgCount = 2;
+    }else if(strcmp(argv[1], "--touch-size") == 0 && argc > 2){
+      char extra;
+      if(sscanf(argv[2], "%dx%d%c", &CONFIG.options.touchWidth, &CONFIG.options.touchHeight, &extra) != 2
+        || CONFIG.options.touchWidth < 1 || CONFIG.options.touchHeight < 1
+      ){
+        printf("ERROR: invalid value for --touch-size: %s\n", argv[2]);
+        exit(1);
+      }
+      optArgCount = 2;
+    }else if(strcmp(argv[1], "--speed") == 0 && argc > 2){
+      char* end;
+      REPLAY_SPEED = strtod(argv[2], &end);
+      if(end == argv[2] || *end != '\0' || REPLAY_SPEED < 0){
+        printf("ERROR: invalid value for --speed: %s\n", argv[2]);
+        exit(1);
+      }
+      optArgCount = 2;
+    }else if(strcmp(argv[1], "--output") == 0 && argc > 2){
+      if(strcmp(argv[2], "uinput") == 0){
+        OUTPUT_TYPE = SINK_UINPUT;
+      }else if(strcmp(argv[2], "null") == 0){
+        OUTPUT_TYPE = SINK_NULL;
+      }else if(strncmp(argv[2], "record:", 7) == 0 && strlen(argv[2]) > 7){
+        OUTPUT_TYPE = SINK_RECORD;
+        OUTPUT_PATH = argv[2] + 7;
+      }else{
+        printf("ERROR: invalid value for --output: %s\n", argv[2]);
+        exit(1);
+      }
+      optArgCount = 2;
+    }else if(strcmp(argv[1], "--devices") == 0 && argc > 2){
+      DEVICE_COUNT = parseIntArg(argv[1], argv[2]);
+      if(DEVICE_COUNT < 1){
+        printf("ERROR: --devices must be at least 1\n");
+        exit(1);
+      }
+      optArgCount = 2;
+    }else if(strcmp(argv[1], "--keys") == 0 && argc > 2){
+      if(strcmp(argv[2], "auto") == 0){
+        KEY_SET_MODE = KEYS_AUTO;
+      }else if(strcmp(argv[2], "exact") == 0){
+        KEY_SET_MODE = KEYS_EXACT;
+      }else if(strcmp(argv[2], "named") == 0){
+        KEY_SET_MODE = KEYS_NAMED;
+      }else if(strcmp(argv[2], "all") == 0){
+        KEY_SET_MODE = KEYS_ALL;
+      }else if(strcmp(argv[2], "legacy") == 0){
+        KEY_SET_MODE = KEYS_LEGACY;
+      }else{
+        printf("ERROR: invalid value for --keys: %s\n", argv[2]);
+        exit(1);
+      }
+      optArgCount = 2;
+    }else{
+      printf(USAGE, argv[0], DEFAULT_SOCKET_PATH, BENCH_KEYSTROKES, LAYOUT_DIR, CONFIG.options.swipeMillis);
+      exit(1);
+    }
+    argv[optArgCount] = argv[0];
+    argv += optArgCount;
+    argc -= optArgCount;
+  }
+
+  //registered with atexit(), so that failed runs are reported too
+  if(STATS_MODE != STATS_OFF){
+    STATS.enabled = true;
+    atexit(printStats);
+  }
+
+  if(layoutName != NULL && !loadLayout(layoutName, &CONFIG.layout)){
+    exit(1);
+  }
+
   if(argc == 2 && (strcmp(argv[1], "-h") == 0 || strcmp(argv[1], "--help") == 0)){
-    printf(USAGE, argv[0]);
+    printf(USAGE, argv[0], DEFAULT_SOCKET_PATH, BENCH_KEYSTROKES, LAYOUT_DIR, CONFIG.options.swipeMillis);
     exit(0);
+  }else if(argc == 2 && strcmp(argv[1], "daemon") == 0) {
+    KeySet keys;
+    if(KEY_SET_MODE == KEYS_LEGACY){
+      addLegacyKeys(&keys);
+    }else if(KEY_SET_MODE == KEYS_ALL){
+      addAllKeys(&keys, &CONFIG.layout);
+    }else{
+      addNamedKeys(&keys, &CONFIG.layout);
+    }
+    markPhase(&STATS, PHASE_PARSE);
+    EventBuffer evBuf;
+    evBuf.config = &CONFIG;
+    if(!openSink(&evBuf.sink, OUTPUT_TYPE, OUTPUT_PATH, &keys, &CONFIG)){
+      exit(1);
+    }
+    runDaemon(&evBuf, getSocketPath());
+    markPhase(&STATS, PHASE_RUN);
+    closeSink(&evBuf.sink, &CONFIG);
+    exit(0);
+  }else if((argc == 2 || argc == 3) && strcmp(argv[1], "bench") == 0) {
+    exit(runBench(argc == 3 ? parseIntArg("KEYSTROKES", argv[2]) : BENCH_KEYSTROKES));
+  }else if(argc == 4 && strcmp(argv[1], "record") == 0) {
+    exit(runRecord(argv[2], argv[3]));
+  }else if(argc == 3 && strcmp(argv[1], "replay") == 0) {
+    const LogRecord* records;
+    size_t recordCount, mapSize;
+    if(!mapLog(argv[2], &records, &recordCount, &mapSize)){
+      exit(1);
+    }
+    KeySet keys;
+    if(KEY_SET_MODE == KEYS_LEGACY){
+      addLegacyKeys(&keys);
+    }else if(KEY_SET_MODE == KEYS_NAMED){
+      addNamedKeys(&keys, &CONFIG.layout);
+    }else if(KEY_SET_MODE == KEYS_ALL){
+      addAllKeys(&keys, &CONFIG.layout);
+    }else{
+      addLogKeys(&keys, records, recordCount);
+    }
+    if(POINTER_AUTO){
+      CONFIG.options.pointerTypes = logPointerTypes(records, recordCount);
+    }
+    markPhase(&STATS, PHASE_PARSE);
+
+    EventBuffer evBuf;
+    evBuf.config = &CONFIG;
+    if(!openSink(&evBuf.sink, OUTPUT_TYPE, OUTPUT_PATH, &keys, &CONFIG)){
+      exit(1);
+    }
+    bool ok = replayLog(&evBuf, records, recordCount, REPLAY_SPEED);
+    markPhase(&STATS, PHASE_RUN);
+    closeSink(&evBuf.sink, &CONFIG);
+    munmap((void*)records, mapSize);
+    exit(reportWriteErrors(&evBuf) && ok ? 0 : 1);
+  }else if(argc == 4 && strcmp(argv[1], "client") == 0) {
+    exit(runClient(getSocketPath(), argv[2], argv[3]));
+  }else if(argc >= 2 && strcmp(argv[1], "script") == 0 && (argc > 3 || DEVICE_COUNT > 1)) {
+    const char* stdinPaths[] = {"-"};
+    const char* const* paths = argc > 2 ? argv + 2 : stdinPaths;
+    int pathCount = argc > 2 ? argc - 2 : 1;
+    exit(runDevices(DEVICE_COUNT > 0 ? DEVICE_COUNT : pathCount, paths, pathCount));
+  }else if((argc == 2 || argc == 3) && strcmp(argv[1], "script") == 0) {
+    if(argc == 2 || strcmp(argv[2], "-") == 0){
+      scriptFile = stdin;
+    }else{
+      scriptFile = fopen(argv[2], "r");
+      if(scriptFile == NULL){
+        printf("ERROR: could not open %s (%s)\n", argv[2], strerror(errno));
+        exit(1);
+      }
+    }
+  }else if(argc >= 2 && motionCommandType(argv[1]) != 0) {
+    //the rest of the args, as a script line would have them
+    cmd = argv[1];
+    for(int i = 2; i < argc; i++){
+      arg += (i > 2 ? " " : "") + std::string(argv[i]);
+    }
   }else if(argc == 2) {
-    typeStr = argv[1];
-  }else if(argc == 3 && strcmp(argv[1], "type") == 0) {
-    typeStr = strdup(argv[2]);
-  }else if(argc == 3 && strcmp(argv[1], "key") == 0) {
-    keyCmdStr = strdup(argv[2]);
+    cmd = "type";
+    arg = argv[1];
+  }else if(argc == 3 && (strcmp(argv[1], "type") == 0 || strcmp(argv[1], "key") == 0)) {
+    cmd = argv[1];
+    arg = argv[2];
   }else{
-    printf(USAGE, argv[0]);
+    printf(USAGE, argv[0], DEFAULT_SOCKET_PATH, BENCH_KEYSTROKES, LAYOUT_DIR, CONFIG.options.swipeMillis);
     exit(1);
   }
 
-  struct uinput_user_dev uinputDev;
+  CommandPlan plan;
+  if (cmd != NULL) {
+    if (!compileCommand(cmd, arg.c_str(), &CONFIG, &plan)) {
+      exit(1);
+    }
+    if (POINTER_AUTO) {
+      CONFIG.options.pointerTypes = plan.pointerTypes;
+    }
+  }
+
+  KeySet keys;
+  if (KEY_SET_MODE == KEYS_LEGACY) {
+    addLegacyKeys(&keys);
+  } else if (KEY_SET_MODE == KEYS_NAMED) {
+    addNamedKeys(&keys, &CONFIG.layout);
+  } else if (KEY_SET_MODE == KEYS_ALL) {
+    addAllKeys(&keys, &CONFIG.layout);
+  } else if (cmd != NULL) {
+    addCommandKeys(&keys, &plan);
+  } else if (scriptFile != NULL && KEY_SET_MODE == KEYS_EXACT) {
+    if (!addScriptKeys(&keys, scriptFile)) {
+      exit(1);
+    }
+  } else {
+    addNamedKeys(&keys, &CONFIG.layout);
+  }
 
-  int uinputFD = open("/dev/uinput", O_WRONLY | O_NONBLOCK);
+  markPhase(&STATS, PHASE_PARSE);
 
-  ioctl(uinputFD, UI_SET_EVBIT, EV_KEY);
-  for (int i=0; i < 256; i++) {
-    ioctl(uinputFD, UI_SET_KEYBIT, i);
+  EventBuffer evBuf;
+  evBuf.config = &CONFIG;
+  if (!openSink(&evBuf.sink, OUTPUT_TYPE, OUTPUT_PATH, &keys, &CONFIG)) {
+    exit(1);
   }
 
-  memset(&uinputDev, 0, sizeof(uinputDev));
-  snprintf(uinputDev.name, UINPUT_MAX_NAME_SIZE, "legacy uinput keyboard");
-  write(uinputFD, &uinputDev, sizeof(uinputDev));
+  bool ok = true;
+  if (cmd != NULL) {
+    ok = checkCommandPlan(&evBuf.sink, &plan) && emitCommandPlan(&evBuf, &plan);
+  }
+  if (scriptFile != NULL) {
+    ok = runScript(&evBuf, scriptFile);
+  }
+  markPhase(&STATS, PHASE_RUN);
 
-  ioctl(uinputFD, UI_DEV_CREATE);
+  closeSink(&evBuf.sink, &CONFIG);
 
-  usleep(DEVICE_INIT_DELAY_MILLIS * 1000);
+  if (!reportWriteErrors(&evBuf) || !ok) {
+    exit(1);
+  }
+}
 
-  if (typeStr != NULL) {
-    typeString(uinputFD, typeStr);
+//reads the whole script to find the keys it needs, validating every line, and then rewinds it
+//  the script must be a seekable file, not a pipe
+bool addScriptKeys(KeySet* keys, FILE* file) {
+  if (fseek(file, 0, SEEK_SET) != 0) {
+    printf("ERROR: --keys exact needs a script file that can be read twice, not a pipe\n");
+    return false;
   }
-  if (keyCmdStr != NULL) {
-    pressKeyCmd(uinputFD, extractKeyCmd(keyCmdStr));
+
+  addBaseKeys(keys);
+  //compiled with a copy of the configuration, so that the run starts from the same touch tracking id
+  Config scanConfig = CONFIG;
+
+  char* line = NULL;
+  size_t lineCap = 0;
+  long lineNum = 0;
+  bool ok = true;
+  while (ok && getline(&line, &lineCap, file) >= 0) {
+    lineNum++;
+    char* cmd;
+    char* arg;
+    if (!splitScriptLine(line, &cmd, &arg)) {
+      continue;
+    }
+
+    CommandPlan plan;
+    ok = compileCommand(cmd, arg, &scanConfig, &plan);
+    if (ok) {
+      addCommandKeys(keys, &plan);
+      if (POINTER_AUTO) {
+        CONFIG.options.pointerTypes |= plan.pointerTypes;
+      }
+    }
+
+    if (!ok) {
+      printf("ERROR: script failed at line %ld\n", lineNum);
+    }
   }
+  free(line);
+
+  rewind(file);
+  return ok;
 }
 
-constexpr u_int64_t hash(const char* s, size_t index) {
-  return s + index == nullptr || s[index] == '\0' ? 55 : hash(s, index + 1) * 33 + (unsigned char)(s[index]);
+//effective keystroke rate is keystrokes over the time spent typing them, including pacing
+void printStats() {
+  long long totalNanos = 0;
+  for (int i = 0; i < PHASE_COUNT; i++) {
+    totalNanos += STATS.phaseNanos[i];
+  }
+  double keystrokeRate = STATS.typingNanos > 0 ? STATS.keystrokeCount * 1e9 / STATS.typingNanos : 0;
+  long long p50 = latencyPercentile(&STATS.writeLatency, 50);
+  long long p99 = latencyPercentile(&STATS.writeLatency, 99);
+
+  if (STATS_MODE == STATS_JSON) {
+    printf("{\"phases_ms\": {");
+    for (int i = 0; i < PHASE_COUNT; i++) {
+      printf("%s\"%s\": %.3f", i > 0 ? ", " : "", PHASE_NAMES[i], STATS.phaseNanos[i] / 1e6);
+    }
+    printf("}, \"total_ms\": %.3f", totalNanos / 1e6);
+    printf(", \"events\": %lld, \"write_syscalls\": %lld, \"bytes\": %lld",
+      STATS.eventCount, STATS.syscallCount, STATS.byteCount);
+    printf(", \"write_latency_ns\": {\"p50\": %lld, \"p99\": %lld, \"max\": %lld}",
+      p50, p99, STATS.writeLatency.maxNanos);
+    printf(", \"keystrokes\": %lld, \"keystroke_rate\": %.1f}\n",
+      STATS.keystrokeCount, keystrokeRate);
+  } else {
+    printf("stats: phases:");
+    for (int i = 0; i < PHASE_COUNT; i++) {
+      printf(" %s=%.3fms", PHASE_NAMES[i], STATS.phaseNanos[i] / 1e6);
+    }
+    printf(" total=%.3fms\n", totalNanos / 1e6);
+    printf("stats: %lld events, %lld write syscalls, %lld bytes\n",
+      STATS.eventCount, STATS.syscallCount, STATS.byteCount);
+    printf("stats: write latency p50=%lldns p99=%lldns max=%lldns\n",
+      p50, p99, STATS.writeLatency.maxNanos);
+    printf("stats: %lld keystrokes at %.1f/s\n", STATS.keystrokeCount, keystrokeRate);
+  }
 }
 
-void emitKeyEvent(int uinputFD, int keyCode, bool pressed) {
-   writeEvent(uinputFD, EV_KEY, keyCode, pressed ? 1 : 0);
-   writeEvent(uinputFD, EV_SYN, SYN_REPORT, 0);
+//exits with an error unless value is a non-negative integer
+int parseIntArg(const char* optName, const char* value) {
+  char* end;
+  long n = strtol(value, &end, 10);
+  if (end == value || *end != '\0' || n < 0 || n > 1000000000L) {
+    printf("ERROR: invalid value for %s: %s\n", optName, value);
+    exit(1);
+  }
+  return n;
 }
 
-void writeEvent(int uinputFD, int type, int code, int val) {
-   struct input_event evt;
+const char* getSocketPath() {
+  const char* socketPath = getenv("UDOTOOL_SOCKET");
+  if (socketPath == NULL || strlen(socketPath) == 0) {
+    socketPath = DEFAULT_SOCKET_PATH;
+  }
+  if (strlen(socketPath) >= sizeof(((struct sockaddr_un*)0)->sun_path)) {
+    printf("ERROR: socket path is too long: %s\n", socketPath);
+    exit(1);
+  }
+  return socketPath;
+}
 
-   evt.type = type;
-   evt.code = code;
-   evt.value = val;
+void onStopSignal(int sig) {
+  running = 0;
+}
 
-   evt.time.tv_sec = 0;  //ignored
-   evt.time.tv_usec = 0; //ignored
+//on SIGINT/SIGTERM, clear running
+//  no SA_RESTART, so that blocking calls like accept() and read() return EINTR
+void handleStopSignals() {
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = onStopSignal;
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+}
 
-   write(uinputFD, &evt, sizeof(evt));
+//prints an error and returns false unless arg is a sleep the daemon allows
+bool checkRequestSleep(const char* arg) {
+  long millis;
+  if (!parseSleepArg(arg, &millis)) {
+    return false;
+  }
+  if (millis > MAX_REQUEST_SLEEP_MILLIS) {
+    printf("ERROR: the daemon sleeps at most %ld millis per request\n", MAX_REQUEST_SLEEP_MILLIS);
+    return false;
+  }
+  return true;
 }
 
-void typeString(int uinputFD, const char* str) {
-  emitKeyEvent(uinputFD, KEY_LEFTSHIFT, false);
+//each request is one connection: "CMD\0ARG", terminated by the client shutting down writes
+//  the daemon answers "OK\n" or "ERROR\n" and closes the connection
+//  a client that has not sent its whole request within REQUEST_TIMEOUT_MILLIS is dropped
+//  'rate' does not outlast its request, and 'sleep' is capped at MAX_REQUEST_SLEEP_MILLIS
+void runDaemon(EventBuffer* evBuf, const char* socketPath) {
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, socketPath, sizeof(addr.sun_path) - 1);
 
-  int len = strlen(str);
-  for (int i = 0; i < len; i++) {
-    usleep(KEYSTROKE_DELAY_MILLIS * 1000);
-    typeChar(uinputFD, str[i]);
+  int serverFD = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (serverFD < 0) {
+    printf("ERROR: could not create socket (%s)\n", strerror(errno));
+    exit(1);
   }
-}
 
-void typeChar(int uinputFD, char c) {
-  const char* keyName;
-  switch(c){
-    case '\n':    keyName="enter";           break;
-    case '\033':  keyName="escape";          break;
-    case '\t':    keyName="tab";             break;
-    case ' ':     keyName="space";           break;
-    case '!':     keyName="bang";            break;
-    case '"':     keyName="doublequote";     break;
-    case '#':     keyName="hash";            break;
-    case '$':     keyName="dollar";          break;
-    case '%':     keyName="percent";         break;
-    case '&':     keyName="ampersand";       break;
-    case '\'':    keyName="apostrophe";      break;
-    case '(':     keyName="leftparens";      break;
-    case ')':     keyName="rightparens";     break;
-    case '*':     keyName="asterisk";        break;
-    case '+':     keyName="plus";            break;
-    case ',':     keyName="comma";           break;
-    case '-':     keyName="dash";            break;
-    case '.':     keyName="period";          break;
-    case '/':     keyName="slash";           break;
-    case '0':     keyName="0";               break;
-    case '1':     keyName="1";               break;
-    case '2':     keyName="2";               break;
-    case '3':     keyName="3";               break;
-    case '4':     keyName="4";               break;
-    case '5':     keyName="5";               break;
-    case '6':     keyName="6";               break;
-    case '7':     keyName="7";               break;
-    case '8':     keyName="8";               break;
-    case '9':     keyName="9";               break;
-    case ':':     keyName="colon";           break;
-    case ';':     keyName="semicolon";       break;
-    case '<':     keyName="less";            break;
-    case '=':     keyName="equal";           break;
-    case '>':     keyName="greater";         break;
-    case '?':     keyName="question";        break;
-    case '@':     keyName="at";              break;
-    case 'A':     keyName="A";               break;
-    case 'B':     keyName="B";               break;
-    case 'C':     keyName="C";               break;
-    case 'D':     keyName="D";               break;
-    case 'E':     keyName="E";               break;
-    case 'F':     keyName="F";               break;
-    case 'G':     keyName="G";               break;
-    case 'H':     keyName="H";               break;
-    case 'I':     keyName="I";               break;
-    case 'J':     keyName="J";               break;
-    case 'K':     keyName="K";               break;
-    case 'L':     keyName="L";               break;
-    case 'M':     keyName="M";               break;
-    case 'N':     keyName="N";               break;
-    case 'O':     keyName="O";               break;
-    case 'P':     keyName="P";               break;
-    case 'Q':     keyName="Q";               break;
-    case 'R':     keyName="R";               break;
-    case 'S':     keyName="S";               break;
-    case 'T':     keyName="T";               break;
-    case 'U':     keyName="U";               break;
-    case 'V':     keyName="V";               break;
-    case 'W':     keyName="W";               break;
-    case 'X':     keyName="X";               break;
-    case 'Y':     keyName="Y";               break;
-    case 'Z':     keyName="Z";               break;
-    case '[':     keyName="leftbracket";     break;
-    case '\\':    keyName="backslash";       break;
-    case ']':     keyName="rightbracket";    break;
-    case '^':     keyName="caret";           break;
-    case '_':     keyName="underscore";      break;
-    case '`':     keyName="grave";           break;
-    case 'a':     keyName="a";               break;
-    case 'b':     keyName="b";               break;
-    case 'c':     keyName="c";               break;
-    case 'd':     keyName="d";               break;
-    case 'e':     keyName="e";               break;
-    case 'f':     keyName="f";               break;
-    case 'g':     keyName="g";               break;
-    case 'h':     keyName="h";               break;
-    case 'i':     keyName="i";               break;
-    case 'j':     keyName="j";               break;
-    case 'k':     keyName="k";               break;
-    case 'l':     keyName="l";               break;
-    case 'm':     keyName="m";               break;
-    case 'n':     keyName="n";               break;
-    case 'o':     keyName="o";               break;
-    case 'p':     keyName="p";               break;
-    case 'q':     keyName="q";               break;
-    case 'r':     keyName="r";               break;
-    case 's':     keyName="s";               break;
-    case 't':     keyName="t";               break;
-    case 'u':     keyName="u";               break;
-    case 'v':     keyName="v";               break;
-    case 'w':     keyName="w";               break;
-    case 'x':     keyName="x";               break;
-    case 'y':     keyName="y";               break;
-    case 'z':     keyName="z";               break;
-    case '{':     keyName="leftbrace";       break;
-    case '|':     keyName="pipe";            break;
-    case '}':     keyName="rightbrace";      break;
-    case '~':     keyName="tilde";           break;
-  }
-
-  if(keyName != NULL){
-    struct KeyCmd keyCmd;
-    keyCmd.keyName = strdup(keyName);
-    pressKeyCmd(uinputFD, keyCmd);
+  int socketMode = DEFAULT_SOCKET_MODE;
+  const char* socketModeStr = getenv("UDOTOOL_SOCKET_MODE");
+  if (socketModeStr != NULL && strlen(socketModeStr) > 0) {
+    char* end;
+    socketMode = strtol(socketModeStr, &end, 8);
+    if (*end != '\0' || socketMode < 0 || socketMode > 0777) {
+      printf("ERROR: invalid value for UDOTOOL_SOCKET_MODE: %s\n", socketModeStr);
+      exit(1);
+    }
+  }
+
+  //refuse to steal the socket of a live daemon, but clean up a stale one
+  if (connect(serverFD, (struct sockaddr*)&addr, sizeof(addr)) == 0) {
+    printf("ERROR: a daemon is already listening on %s\n", socketPath);
+    exit(1);
+  }
+  close(serverFD);
+  struct stat st;
+  if (lstat(socketPath, &st) == 0) {
+    if (!S_ISSOCK(st.st_mode)) {
+      printf("ERROR: %s exists and is not a socket\n", socketPath);
+      exit(1);
+    }
+    unlink(socketPath);
+  }
+
+  //created with its final permissions, so there is no moment another user could connect
+  serverFD = socket(AF_UNIX, SOCK_STREAM, 0);
+  mode_t savedMask = umask(0777 & ~socketMode);
+  int bound = bind(serverFD, (struct sockaddr*)&addr, sizeof(addr));
+  umask(savedMask);
+  if (bound < 0) {
+    printf("ERROR: could not bind %s (%s)\n", socketPath, strerror(errno));
+    exit(1);
   }
+
+  if (listen(serverFD, 16) < 0) {
+    printf("ERROR: could not listen on %s (%s)\n", socketPath, strerror(errno));
+    exit(1);
+  }
+
+  handleStopSignals();
+  signal(SIGPIPE, SIG_IGN);
+
+  //errors for rejected requests should show up in logs immediately
+  setvbuf(stdout, NULL, _IOLBF, 0);
+
+  char* request = (char*)malloc(MAX_REQUEST_SIZE + 1);
+
+  while (running) {
+    int clientFD = accept(serverFD, NULL, NULL);
+    if (clientFD < 0) {
+      continue;
+    }
+
+    int len = 0;
+    bool timedOut = false;
+    long long deadline = nowNanos() + REQUEST_TIMEOUT_MILLIS * 1000000LL;
+    while (len < MAX_REQUEST_SIZE) {
+      long long remainingMillis = (deadline - nowNanos()) / 1000000LL;
+      struct pollfd pfd = {clientFD, POLLIN, 0};
+      int ready = remainingMillis > 0 ? poll(&pfd, 1, remainingMillis) : 0;
+      if (ready < 0 && errno == EINTR && running) {
+        continue;
+      } else if (ready == 0) {
+        timedOut = true;
+        break;
+      } else if (ready < 0) {
+        break;
+      }
+      ssize_t n = read(clientFD, request + len, MAX_REQUEST_SIZE - len);
+      if (n < 0 && errno == EINTR && running) {
+        continue;
+      } else if (n <= 0) {
+        break;
+      }
+      len += n;
+    }
+    request[len] = '\0';
+
+    if (timedOut) {
+      printf("ERROR: timed out reading a request, dropping the client\n");
+      close(clientFD);
+      continue;
+    }
+
+    bool ok = false;
+    long droppedBefore = evBuf->droppedEventCount;
+    size_t cmdLen = strlen(request);
+    const char* arg = request + cmdLen + 1;
+    if (len >= MAX_REQUEST_SIZE) {
+      printf("ERROR: request exceeds %d bytes\n", MAX_REQUEST_SIZE);
+    } else if ((int)cmdLen >= len) {
+      printf("ERROR: malformed request\n");
+    } else if (strcmp(request, "sleep") == 0 && !checkRequestSleep(arg)) {
+      ok = false;
+    } else {
+      //a 'rate' only applies to its own request, not to the other clients
+      int savedRate = evBuf->config->options.keystrokeRate;
+      ok = runCommand(evBuf, request, arg);
+      ok = ok && evBuf->droppedEventCount == droppedBefore;
+      evBuf->config->options.keystrokeRate = savedRate;
+    }
+
+    const char* response = ok ? "OK\n" : "ERROR\n";
+    write(clientFD, response, strlen(response));
+    close(clientFD);
+  }
+
+  free(request);
+  close(serverFD);
+  unlink(socketPath);
 }
 
-KeyCmd extractKeyCmd(const char* keyCmdStr) {
-  struct KeyCmd keyCmd;
-
-  int len = strlen(keyCmdStr);
-  int start = 0;
-  for (int i=0; i<len; i++) {
-    if (keyCmdStr[i] == '+') {
-      char modName[i-start];
-      memcpy(modName, &keyCmdStr[start], i-start);
-      modName[i-start] = '\0';
-
-      if (strcmp(toLower(modName), "ctrl") == 0){
-        keyCmd.ctrl = true;
-      } else if (strcmp(toLower(modName), "alt") == 0){
-        keyCmd.alt = true;
-      } else if (strcmp(toLower(modName), "super") == 0){
-        keyCmd.super = true;
-      } else if (strcmp(toLower(modName), "shift") == 0){
-        keyCmd.forceShift = true;
+int runClient(const char* socketPath, const char* cmd, const char* arg) {
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, socketPath, sizeof(addr.sun_path) - 1);
+
+  int clientFD = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (clientFD < 0 || connect(clientFD, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+    printf("ERROR: could not connect to daemon at %s (%s)\n", socketPath, strerror(errno));
+    return 1;
+  }
+
+  signal(SIGPIPE, SIG_IGN);
+
+  bool sent = true;
+  const char* bufs[] = {cmd, arg};
+  for (const char* buf : bufs) {
+    //include the NUL terminator, which separates CMD from ARG
+    size_t remaining = strlen(buf) + 1;
+    while (sent && remaining > 0) {
+      ssize_t n = write(clientFD, buf, remaining);
+      if (n < 0 && errno == EINTR) {
+        continue;
+      } else if (n <= 0) {
+        sent = false;
       } else {
-        printf("ERROR: unknown modified %s\n", modName);
-        exit(1);
+        buf += n;
+        remaining -= n;
       }
-      start = i+1;
     }
   }
+  shutdown(clientFD, SHUT_WR);
 
-  keyCmd.keyName = strdup(&keyCmdStr[start]);
-  return keyCmd;
+  char response[16];
+  int len = 0;
+  while (len < (int)sizeof(response) - 1) {
+    ssize_t n = read(clientFD, response + len, sizeof(response) - 1 - len);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    } else if (n <= 0) {
+      break;
+    }
+    len += n;
+  }
+  response[len] = '\0';
+  close(clientFD);
+
+  if (!sent || strcmp(response, "OK\n") != 0) {
+    printf("ERROR: daemon failed to run command '%s'\n", cmd);
+    return 1;
+  }
+  return 0;
+}
+
+int runRecord(const char* devPath, const char* logPath) {
+  int evdevFD = open(devPath, O_RDONLY | O_CLOEXEC);
+  if (evdevFD < 0) {
+    printf("ERROR: could not open %s (%s)\n", devPath, strerror(errno));
+    return 1;
+  }
+  //monotonic event timestamps, so that clock changes cannot distort the timing
+  int clockId = CLOCK_MONOTONIC;
+  ioctl(evdevFD, EVIOCSCLOCKID, &clockId);
+
+  FILE* log = fopen(logPath, "w");
+  if (log == NULL) {
+    printf("ERROR: could not open %s (%s)\n", logPath, strerror(errno));
+    close(evdevFD);
+    return 1;
+  }
+
+  LogHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, LOG_MAGIC, sizeof(header.magic));
+  header.recordSize = sizeof(LogRecord);
+  fwrite(&header, sizeof(header), 1, log);
+
+  handleStopSignals();
+
+  long long prevMicros = -1;
+  long recordCount = 0;
+  struct input_event events[64];
+  while (running) {
+    ssize_t n = read(evdevFD, events, sizeof(events));
+    if (n < 0 && errno == EINTR) {
+      continue;
+    } else if (n <= 0) {
+      if (n < 0) {
+        printf("ERROR: could not read %s (%s)\n", devPath, strerror(errno));
+      }
+      break;
+    }
+
+    for (size_t i = 0; i < n / sizeof(struct input_event); i++) {
+      long long micros = events[i].time.tv_sec * 1000000LL + events[i].time.tv_usec;
+      long long delta = prevMicros < 0 || micros < prevMicros ? 0 : micros - prevMicros;
+      prevMicros = micros;
+
+      LogRecord record;
+      record.deltaMicros = delta > UINT32_MAX ? UINT32_MAX : delta;
+      record.type = events[i].type;
+      record.code = events[i].code;
+      record.value = events[i].value;
+      fwrite(&record, sizeof(record), 1, log);
+      recordCount++;
+    }
+  }
+
+  close(evdevFD);
+  bool ok = fclose(log) == 0;
+  if (!ok) {
+    printf("ERROR: could not write %s (%s)\n", logPath, strerror(errno));
+  }
+  printf("recorded %ld events to %s\n", recordCount, logPath);
+  return ok ? 0 : 1;
+}
+
+int runBench(long keystrokes) {
+  if (!benchPipeline(keystrokes)) {
+    return 1;
+  }
+  if (access("/dev/uinput", W_OK) == 0) {
+    benchLoopback(BENCH_LOOPBACK_ITERATIONS);
+  } else {
+    printf("loopback: skipped, /dev/uinput is not writable\n");
+  }
+  return 0;
+}
+
+//a script of 'type' lines with mixed shifted and unshifted text, and a 'key' every 16 lines,
+//  run BENCH_RUNS times into a null sink at an unlimited rate, reporting the fastest run
+//prints an error and returns false, without numbers, if the script fails
+bool benchPipeline(long keystrokes) {
+  const char* sample = "The quick brown fox jumps over the lazy dog! 0123456789 (x+y)*z={a|b}; ";
+  int sampleLen = strlen(sample);
+  int lineLen = 64;
+
+  std::string script;
+  long typed = 0;
+  long lines = 0;
+  while (typed < keystrokes) {
+    if (lines % 16 == 15) {
+      script += "key ctrl+shift+Home\n";
+      typed++;
+    } else {
+      script += "type ";
+      for (int i = 0; i < lineLen && typed < keystrokes; i++, typed++) {
+        script += sample[typed % sampleLen];
+      }
+      script += "\n";
+    }
+    lines++;
+  }
+
+  //at an unlimited rate, with a copy of the configuration so that nothing else runs at it
+  Config benchConfig = CONFIG;
+  benchConfig.options.keystrokeRate = 0;
+
+  long long bestNanos = -1;
+  long events = 0;
+  bool ok = true;
+  for (int run = 0; ok && run < BENCH_RUNS; run++) {
+    FILE* file = fmemopen((void*)script.data(), script.size(), "r");
+    //with the key set of a script run, so that no key command is rejected
+    KeySet keys;
+    addNamedKeys(&keys, &benchConfig.layout);
+    EventBuffer evBuf;
+    evBuf.config = &benchConfig;
+    openSink(&evBuf.sink, SINK_NULL, NULL, &keys, &benchConfig);
+
+    long long start = nowNanos();
+    ok = runScript(&evBuf, file);
+    ok = flushEvents(&evBuf) && ok;
+    long long elapsed = nowNanos() - start;
+
+    closeSink(&evBuf.sink, &benchConfig);
+    fclose(file);
+    events = evBuf.eventCount;
+    if (bestNanos < 0 || elapsed < bestNanos) {
+      bestNanos = elapsed;
+    }
+  }
+
+  if (!ok) {
+    printf("ERROR: the benchmark script failed\n");
+    return false;
+  }
+  printf("pipeline: %ld keystrokes, %ld lines, %ld events, best of %d runs: %.3fms\n",
+    typed, lines, events, BENCH_RUNS, bestNanos / 1e6);
+  printf("pipeline: %.0f events/s, %.1f ns/keystroke\n",
+    events * 1e9 / bestNanos, (double)bestNanos / typed);
+  return true;
+}
+
+//presses and releases one key on a new uinput device, reading each event back from its evdev node
+void benchLoopback(int iterations) {
+  int benchKey = KEY_F24;
+  KeySet keys;
+  addBaseKeys(&keys);
+  keys.set(benchKey);
+
+  EventBuffer evBuf;
+  evBuf.config = &CONFIG;
+  if (!openSink(&evBuf.sink, SINK_UINPUT, NULL, &keys, &CONFIG)) {
+    return;
+  }
+  const char* devPath = evBuf.sink.devPath;
+  if (devPath[0] == '\0') {
+    printf("loopback: skipped, could not find the event node of the device\n");
+    closeSink(&evBuf.sink, &CONFIG);
+    return;
+  }
+
+  int evdevFD = open(devPath, O_RDONLY | O_CLOEXEC);
+  if (evdevFD < 0 || ioctl(evdevFD, EVIOCGRAB, 1) < 0) {
+    printf("loopback: skipped, could not grab %s (%s)\n", devPath, strerror(errno));
+    if (evdevFD >= 0) {
+      close(evdevFD);
+    }
+    closeSink(&evBuf.sink, &CONFIG);
+    return;
+  }
+
+  LatencyHistogram latency;
+  bool ok = true;
+  for (int i = 0; ok && i < iterations * 2; i++) {
+    long long start = nowNanos();
+    emitKeyEvent(&evBuf, benchKey, i % 2 == 0);
+    ok = flushEvents(&evBuf);
+
+    //the key event, then its SYN_REPORT
+    struct input_event evt;
+    do {
+      ok = ok && read(evdevFD, &evt, sizeof(evt)) == sizeof(evt);
+    } while (ok && !(evt.type == EV_SYN && evt.code == SYN_REPORT));
+
+    if (ok) {
+      recordLatency(&latency, nowNanos() - start);
+    }
+  }
+
+  ioctl(evdevFD, EVIOCGRAB, 0);
+  close(evdevFD);
+  closeSink(&evBuf.sink, &CONFIG);
+
+  if (!ok) {
+    printf("loopback: failed reading back events from %s\n", devPath);
+    return;
+  }
+  printf("loopback: %s, %lld events, write to read latency p50=%lldns p99=%lldns max=%lldns\n",
+    devPath, latency.count,
+    latencyPercentile(&latency, 50), latencyPercentile(&latency, 99), latency.maxNanos);
+}
+
+//runs the script of each device until it ends, all on one epoll loop
+//  paths is one script for every device, or one per device
+int runDevices(int deviceCount, const char* const* paths, int pathCount) {
+  if (pathCount != 1 && pathCount != deviceCount) {
+    printf("ERROR: %d devices need 1 or %d script FILEs, not %d\n", deviceCount, deviceCount, pathCount);
+    return 1;
+  }
+
+  std::vector<DeviceStream> streams(deviceCount);
+  int stdinCount = 0;
+  for (int i = 0; i < deviceCount; i++) {
+    DeviceStream* stream = &streams[i];
+    const char* path = paths[pathCount == 1 ? 0 : i];
+    stream->index = i + 1;
+    stream->scriptPath = path;
+    struct stat st;
+    if (strcmp(path, "-") == 0 && (fstat(STDIN_FILENO, &st) != 0 || !S_ISREG(st.st_mode))) {
+      stream->scriptFD = STDIN_FILENO;
+      stdinCount++;
+    } else {
+      //stdin redirected from a file is opened again, so that each stream has its own offset
+      path = strcmp(path, "-") == 0 ? "/proc/self/fd/0" : path;
+      stream->scriptFD = open(path, O_RDONLY | O_CLOEXEC);
+      if (stream->scriptFD < 0) {
+        printf("ERROR: could not open %s (%s)\n", path, strerror(errno));
+        return 1;
+      }
+    }
+
+    //only regular files can be read again from the start, by each device
+    bool regular = fstat(stream->scriptFD, &st) == 0 && S_ISREG(st.st_mode);
+    if (!regular && ((pathCount == 1 && deviceCount > 1) || stdinCount > 1)) {
+      printf("ERROR: a script from stdin or a pipe can only run on one device: %s\n", path);
+      return 1;
+    }
+    if (!regular) {
+      stream->savedFlags = fcntl(stream->scriptFD, F_GETFL);
+      fcntl(stream->scriptFD, F_SETFL, stream->savedFlags | O_NONBLOCK);
+    }
+  }
+
+  KeySet keys;
+  if (KEY_SET_MODE == KEYS_LEGACY) {
+    addLegacyKeys(&keys);
+  } else if (KEY_SET_MODE == KEYS_ALL) {
+    addAllKeys(&keys, &CONFIG.layout);
+  } else if (KEY_SET_MODE == KEYS_EXACT) {
+    for (int i = 0; i < pathCount; i++) {
+      //the FILE shares the script's offset, which is reset for the loop
+      FILE* file = fdopen(dup(streams[i].scriptFD), "r");
+      bool ok = file != NULL && addScriptKeys(&keys, file);
+      if (file != NULL) {
+        fclose(file);
+      }
+      if (!ok) {
+        printf("ERROR: in %s\n", streams[i].scriptPath);
+        return 1;
+      }
+      lseek(streams[i].scriptFD, 0, SEEK_SET);
+    }
+  } else {
+    addNamedKeys(&keys, &CONFIG.layout);
+  }
+  markPhase(&STATS, PHASE_PARSE);
+
+  std::vector<EventSink> sinks(deviceCount);
+  if (!openSinks(sinks.data(), deviceCount, OUTPUT_TYPE, OUTPUT_PATH, &keys, &CONFIG)) {
+    return 1;
+  }
+
+  int epollFD = epoll_create1(EPOLL_CLOEXEC);
+  if (epollFD < 0) {
+    printf("ERROR: could not create epoll instance (%s)\n", strerror(errno));
+    return 1;
+  }
+  for (DeviceStream& stream : streams) {
+    stream.config = CONFIG;
+    stream.evBuf.config = &stream.config;
+    stream.evBuf.sink = sinks[stream.index - 1];
+    initPacer(&stream.pacer, stream.config.options.keystrokeRate, stream.config.options.keystrokeBurst);
+    stream.timerFD = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (stream.timerFD < 0 || !watchStream(epollFD, &stream, stream.timerFD, WATCH_TIMER, EPOLLIN)) {
+      printf("ERROR: could not create timer (%s)\n", strerror(errno));
+      return 1;
+    }
+  }
+
+  handleStopSignals();
+
+  long long startNanos = nowNanos();
+  int activeCount = 0;
+  for (DeviceStream& stream : streams) {
+    advanceStream(&stream, epollFD);
+    activeCount += stream.done ? 0 : 1;
+  }
+
+  struct epoll_event events[64];
+  while (running && activeCount > 0) {
+    int n = epoll_wait(epollFD, events, 64, -1);
+    if (n < 0 && errno != EINTR) {
+      printf("ERROR: epoll_wait failed (%s)\n", strerror(errno));
+      break;
+    }
+
+    for (int i = 0; i < n; i++) {
+      DeviceStream* stream = &streams[events[i].data.u64 / WATCH_COUNT];
+      int watch = events[i].data.u64 % WATCH_COUNT;
+      if (watch == WATCH_TIMER) {
+        uint64_t expirations;
+        read(stream->timerFD, &expirations, sizeof(expirations));
+        if (stream->blockedNanos != 0 && nowNanos() - stream->blockedNanos >= CONFIG.options.writeTimeoutMillis * 1000000LL) {
+          printf("ERROR: device %d: timed out waiting to write to %s\n",
+            stream->index, sinkName(&stream->evBuf.sink));
+          epoll_ctl(epollFD, EPOLL_CTL_DEL, stream->evBuf.sink.fd, NULL);
+          stream->blockedNanos = 0;
+          dropStreamEvents(stream);
+        }
+      } else if (watch == WATCH_INPUT) {
+        epoll_ctl(epollFD, EPOLL_CTL_DEL, stream->scriptFD, NULL);
+        stream->inputWatched = false;
+      } else if (watch == WATCH_OUTPUT) {
+        epoll_ctl(epollFD, EPOLL_CTL_DEL, stream->evBuf.sink.fd, NULL);
+        stream->blockedNanos = 0;
+      }
+
+      if (!stream->done) {
+        advanceStream(stream, epollFD);
+        activeCount -= stream->done ? 1 : 0;
+      }
+    }
+  }
+
+  STATS.typingNanos += nowNanos() - startNanos;
+  markPhase(&STATS, PHASE_RUN);
+
+  bool ok = true;
+  for (DeviceStream& stream : streams) {
+    closeSink(&stream.evBuf.sink, &CONFIG);
+    close(stream.timerFD);
+    if (stream.savedFlags >= 0) {
+      fcntl(stream.scriptFD, F_SETFL, stream.savedFlags);
+    }
+    if (stream.scriptFD != STDIN_FILENO) {
+      close(stream.scriptFD);
+    }
+
+    if (CONFIG.reportRate) {
+      printf("device %d: ", stream.index);
+      reportPacer(&stream.pacer);
+    }
+    if (stream.evBuf.droppedEventCount > 0) {
+      printf("device %d: ", stream.index);
+    }
+    ok = reportWriteErrors(&stream.evBuf) && !stream.failed && ok;
+  }
+  close(epollFD);
+  return ok ? 0 : 1;
 }
 
-void pressKeyCmd(int uinputFD, KeyCmd keyCmd) {
-  int keyCode = -1;
-  bool shift = false;
-
-  char* modKeyName = keyCmd.keyName;
-  //force lowercase for all except single letters
-  if (strlen(modKeyName) > 1) {
-    modKeyName = toLower(modKeyName);
-  }
-
-  switch(hash(modKeyName)){
-    case hash("enter"):           keyCode=KEY_ENTER;         shift=false;  break;
-    case hash("escape"):          keyCode=KEY_ESC;           shift=false;  break;
-    case hash("tab"):             keyCode=KEY_TAB;           shift=false;  break;
-    case hash("capslock"):        keyCode=KEY_CAPSLOCK;      shift=false;  break;
-    case hash("f1"):              keyCode=KEY_F1;            shift=false;  break;
-    case hash("f2"):              keyCode=KEY_F2;            shift=false;  break;
-    case hash("f3"):              keyCode=KEY_F3;            shift=false;  break;
-    case hash("f4"):              keyCode=KEY_F4;            shift=false;  break;
-    case hash("f5"):              keyCode=KEY_F5;            shift=false;  break;
-    case hash("f6"):              keyCode=KEY_F6;            shift=false;  break;
-    case hash("f7"):              keyCode=KEY_F7;            shift=false;  break;
-    case hash("f8"):              keyCode=KEY_F8;            shift=false;  break;
-    case hash("f9"):              keyCode=KEY_F9;            shift=false;  break;
-    case hash("f10"):             keyCode=KEY_F10;           shift=false;  break;
-    case hash("f11"):             keyCode=KEY_F11;           shift=false;  break;
-    case hash("f12"):             keyCode=KEY_F12;           shift=false;  break;
-    case hash("pageup"):          keyCode=KEY_PAGEUP;        shift=false;  break;
-    case hash("pagedown"):        keyCode=KEY_PAGEDOWN;      shift=false;  break;
-    case hash("home"):            keyCode=KEY_HOME;          shift=false;  break;
-    case hash("end"):             keyCode=KEY_END;           shift=false;  break;
-    case hash("insert"):          keyCode=KEY_INSERT;        shift=false;  break;
-    case hash("delete"):          keyCode=KEY_DELETE;        shift=false;  break;
-    case hash("left"):            keyCode=KEY_LEFT;          shift=false;  break;
-    case hash("right"):           keyCode=KEY_RIGHT;         shift=false;  break;
-    case hash("up"):              keyCode=KEY_UP;            shift=false;  break;
-    case hash("down"):            keyCode=KEY_DOWN;          shift=false;  break;
-    case hash("backspace"):       keyCode=KEY_BACKSPACE;     shift=false;  break;
-    case hash("space"):           keyCode=KEY_SPACE;         shift=false;  break;
-    case hash("bang"):            keyCode=KEY_1;             shift=true;   break;
-    case hash("doublequote"):     keyCode=KEY_APOSTROPHE;    shift=true;   break;
-    case hash("hash"):            keyCode=KEY_3;             shift=true;   break;
-    case hash("dollar"):          keyCode=KEY_4;             shift=true;   break;
-    case hash("percent"):         keyCode=KEY_5;             shift=true;   break;
-    case hash("ampersand"):       keyCode=KEY_7;             shift=true;   break;
-    case hash("apostrophe"):      keyCode=KEY_APOSTROPHE;    shift=false;  break;
-    case hash("leftparens"):      keyCode=KEY_9;             shift=true;   break;
-    case hash("rightparens"):     keyCode=KEY_0;             shift=true;   break;
-    case hash("asterisk"):        keyCode=KEY_8;             shift=true;   break;
-    case hash("plus"):            keyCode=KEY_EQUAL;         shift=true;   break;
-    case hash("comma"):           keyCode=KEY_COMMA;         shift=false;  break;
-    case hash("dash"):            keyCode=KEY_MINUS;         shift=false;  break;
-    case hash("period"):          keyCode=KEY_DOT;           shift=false;  break;
-    case hash("slash"):           keyCode=KEY_SLASH;         shift=false;  break;
-    case hash("0"):               keyCode=KEY_0;             shift=false;  break;
-    case hash("1"):               keyCode=KEY_1;             shift=false;  break;
-    case hash("2"):               keyCode=KEY_2;             shift=false;  break;
-    case hash("3"):               keyCode=KEY_3;             shift=false;  break;
-    case hash("4"):               keyCode=KEY_4;             shift=false;  break;
-    case hash("5"):               keyCode=KEY_5;             shift=false;  break;
-    case hash("6"):               keyCode=KEY_6;             shift=false;  break;
-    case hash("7"):               keyCode=KEY_7;             shift=false;  break;
-    case hash("8"):               keyCode=KEY_8;             shift=false;  break;
-    case hash("9"):               keyCode=KEY_9;             shift=false;  break;
-    case hash("colon"):           keyCode=KEY_SEMICOLON;     shift=true;   break;
-    case hash("semicolon"):       keyCode=KEY_SEMICOLON;     shift=false;  break;
-    case hash("less"):            keyCode=KEY_COMMA;         shift=true;   break;
-    case hash("equal"):           keyCode=KEY_EQUAL;         shift=false;  break;
-    case hash("greater"):         keyCode=KEY_DOT;           shift=true;   break;
-    case hash("question"):        keyCode=KEY_SLASH;         shift=true;   break;
-    case hash("at"):              keyCode=KEY_2;             shift=true;   break;
-    case hash("A"):               keyCode=KEY_A;             shift=true;  break;
-    case hash("B"):               keyCode=KEY_B;             shift=true;  break;
-    case hash("C"):               keyCode=KEY_C;             shift=true;  break;
-    case hash("D"):               keyCode=KEY_D;             shift=true;  break;
-    case hash("E"):               keyCode=KEY_E;             shift=true;  break;
-    case hash("F"):               keyCode=KEY_F;             shift=true;  break;
-    case hash("G"):               keyCode=KEY_G;             shift=true;  break;
-    case hash("H"):               keyCode=KEY_H;             shift=true;  break;
-    case hash("I"):               keyCode=KEY_I;             shift=true;  break;
-    case hash("J"):               keyCode=KEY_J;             shift=true;  break;
-    case hash("K"):               keyCode=KEY_K;             shift=true;  break;
-    case hash("L"):               keyCode=KEY_L;             shift=true;  break;
-    case hash("M"):               keyCode=KEY_M;             shift=true;  break;
-    case hash("N"):               keyCode=KEY_N;             shift=true;  break;
-    case hash("O"):               keyCode=KEY_O;             shift=true;  break;
-    case hash("P"):               keyCode=KEY_P;             shift=true;  break;
-    case hash("Q"):               keyCode=KEY_Q;             shift=true;  break;
-    case hash("R"):               keyCode=KEY_R;             shift=true;  break;
-    case hash("S"):               keyCode=KEY_S;             shift=true;  break;
-    case hash("T"):               keyCode=KEY_T;             shift=true;  break;
-    case hash("U"):               keyCode=KEY_U;             shift=true;  break;
-    case hash("V"):               keyCode=KEY_V;             shift=true;  break;
-    case hash("W"):               keyCode=KEY_W;             shift=true;  break;
-    case hash("X"):               keyCode=KEY_X;             shift=true;  break;
-    case hash("Y"):               keyCode=KEY_Y;             shift=true;  break;
-    case hash("Z"):               keyCode=KEY_Z;             shift=true;  break;
-    case hash("leftbracket"):     keyCode=KEY_LEFTBRACE;     shift=false;  break;
-    case hash("backslash"):       keyCode=KEY_BACKSLASH;     shift=false;  break;
-    case hash("rightbracket"):    keyCode=KEY_RIGHTBRACE;    shift=false;  break;
-    case hash("caret"):           keyCode=KEY_6;             shift=true;   break;
-    case hash("underscore"):      keyCode=KEY_MINUS;         shift=true;   break;
-    case hash("grave"):           keyCode=KEY_GRAVE;         shift=false;  break;
-    case hash("a"):               keyCode=KEY_A;             shift=false;  break;
-    case hash("b"):               keyCode=KEY_B;             shift=false;  break;
-    case hash("c"):               keyCode=KEY_C;             shift=false;  break;
-    case hash("d"):               keyCode=KEY_D;             shift=false;  break;
-    case hash("e"):               keyCode=KEY_E;             shift=false;  break;
-    case hash("f"):               keyCode=KEY_F;             shift=false;  break;
-    case hash("g"):               keyCode=KEY_G;             shift=false;  break;
-    case hash("h"):               keyCode=KEY_H;             shift=false;  break;
-    case hash("i"):               keyCode=KEY_I;             shift=false;  break;
-    case hash("j"):               keyCode=KEY_J;             shift=false;  break;
-    case hash("k"):               keyCode=KEY_K;             shift=false;  break;
-    case hash("l"):               keyCode=KEY_L;             shift=false;  break;
-    case hash("m"):               keyCode=KEY_M;             shift=false;  break;
-    case hash("n"):               keyCode=KEY_N;             shift=false;  break;
-    case hash("o"):               keyCode=KEY_O;             shift=false;  break;
-    case hash("p"):               keyCode=KEY_P;             shift=false;  break;
-    case hash("q"):               keyCode=KEY_Q;             shift=false;  break;
-    case hash("r"):               keyCode=KEY_R;             shift=false;  break;
-    case hash("s"):               keyCode=KEY_S;             shift=false;  break;
-    case hash("t"):               keyCode=KEY_T;             shift=false;  break;
-    case hash("u"):               keyCode=KEY_U;             shift=false;  break;
-    case hash("v"):               keyCode=KEY_V;             shift=false;  break;
-    case hash("w"):               keyCode=KEY_W;             shift=false;  break;
-    case hash("x"):               keyCode=KEY_X;             shift=false;  break;
-    case hash("y"):               keyCode=KEY_Y;             shift=false;  break;
-    case hash("z"):               keyCode=KEY_Z;             shift=false;  break;
-    case hash("leftbrace"):       keyCode=KEY_LEFTBRACE;     shift=true;   break;
-    case hash("pipe"):            keyCode=KEY_BACKSLASH;     shift=true;   break;
-    case hash("rightbrace"):      keyCode=KEY_RIGHTBRACE;    shift=true;   break;
-    case hash("tilde"):           keyCode=KEY_GRAVE;         shift=true;   break;
-  }
-
-  if(keyCode > 0){
-    if(keyCmd.ctrl){
-      emitKeyEvent(uinputFD, KEY_LEFTCTRL, true);
-    }
-    if(keyCmd.alt){
-      emitKeyEvent(uinputFD, KEY_LEFTALT, true);
-    }
-    if(keyCmd.super){
-      emitKeyEvent(uinputFD, KEY_LEFTMETA, true); //they use meta for super instead of meta?
-    }
-    if(shift || keyCmd.forceShift){
-      emitKeyEvent(uinputFD, KEY_LEFTSHIFT, true);
-    }
-
-    emitKeyEvent(uinputFD, keyCode, true);
-
-    emitKeyEvent(uinputFD, keyCode, false);
-
-    if(shift || keyCmd.forceShift){
-      emitKeyEvent(uinputFD, KEY_LEFTSHIFT, false);
-    }
-    if(keyCmd.super){
-      emitKeyEvent(uinputFD, KEY_LEFTMETA, false);
-    }
-    if(keyCmd.alt){
-      emitKeyEvent(uinputFD, KEY_LEFTALT, false);
-    }
-    if(keyCmd.ctrl){
-      emitKeyEvent(uinputFD, KEY_LEFTCTRL, false);
+//writes every frame that is due, and runs the next command once the current one is written,
+//  until the stream has to wait for a deadline, for more of its script, or for its sink
+//a stream that keeps going yields after DEVICE_TURN_STEPS, so that it cannot starve the others
+void advanceStream(DeviceStream* stream, int epollFD) {
+  for (int step = 0; stream->blockedNanos == 0; step++) {
+    long long now = nowNanos();
+    if (step >= DEVICE_TURN_STEPS) {
+      armTimer(stream->timerFD, now);
+      return;
+    }
+
+    if (stream->writtenBytes < stream->writeEnd * sizeof(struct input_event)) {
+      writeStreamEvents(stream, epollFD);
+      continue;
+    }
+
+    if (stream->frame < stream->frameEnds.size()) {
+      if (stream->frameDeadlines[stream->frame] > now) {
+        armTimer(stream->timerFD, stream->frameDeadlines[stream->frame]);
+        return;
+      }
+      //frames that are late go out together, in one write
+      while (stream->frame < stream->frameEnds.size() && stream->frameDeadlines[stream->frame] <= now) {
+        stream->frame++;
+      }
+      stream->writeEnd = stream->frameEnds[stream->frame - 1];
+      continue;
+    }
+
+    if (!stream->frameEnds.empty()) {
+      stream->events.clear();
+      stream->frameEnds.clear();
+      stream->frameDeadlines.clear();
+      stream->frame = 0;
+      stream->writtenBytes = 0;
+      stream->writeEnd = 0;
+      stream->pacer.endNanos = now;
+    }
+    if (stream->notBeforeNanos > now) {
+      armTimer(stream->timerFD, stream->notBeforeNanos);
+      return;
+    }
+
+    std::string line;
+    if (!readStreamLine(stream, epollFD, &line)) {
+      return;
+    }
+    stream->lineNum++;
+    char* cmd;
+    char* arg;
+    if (splitScriptLine(&line[0], &cmd, &arg) && !planStreamCommand(stream, cmd, arg, now)) {
+      printf("ERROR: device %d: script failed at line %ld\n", stream->index, stream->lineNum);
+      stream->failed = true;
+      stream->done = true;
+      return;
     }
   }
 }
 
-char* toLower(char* str) {
-  for(int i = 0; str[i]; i++){
-    str[i] = tolower(str[i]);
+//compiles a script command into frames of the stream, each with the deadline it is written at
+//  like runCommand, except that 'sleep' delays the next command and 'rate' only sets this stream's
+bool planStreamCommand(DeviceStream* stream, const char* cmd, const char* arg, long long now) {
+  CommandPlan plan;
+  if (!compileCommand(cmd, arg, &stream->config, &plan)
+    || !checkCommandPlan(&stream->evBuf.sink, &plan)
+  ) {
+    return false;
   }
-  return str;
+  long long startNanos = stream->notBeforeNanos > now ? stream->notBeforeNanos : now;
+  stream->events = std::move(plan.events);
+  stream->frameEnds = std::move(plan.frameEnds);
+  for (long long frameNanos : plan.frameNanos) {
+    stream->frameDeadlines.push_back(startNanos + frameNanos);
+  }
+  if (plan.sleepNanos > 0) {
+    stream->notBeforeNanos = startNanos + plan.sleepNanos;
+  }
+  if (plan.rate >= 0) {
+    stream->config.options.keystrokeRate = plan.rate;
+    stream->pacer.rate = plan.rate;
+  }
+  stream->pacer.keystrokeCount += plan.keystrokeCount;
+  STATS.keystrokeCount += plan.keystrokeCount;
+  return true;
+}
+
+//the next line of the script, read in chunks as it is needed, so a stream never reads
+//  far ahead of what its device has written, and a slow device holds back its writer
+//returns false when the stream has to wait for more of a pipe (watched with epoll),
+//  or at the end of the script, which marks the stream done
+bool readStreamLine(DeviceStream* stream, int epollFD, std::string* line) {
+  while (true) {
+    size_t newline = stream->input.find('\n', stream->inputPos);
+    if (newline != std::string::npos) {
+      line->assign(stream->input, stream->inputPos, newline + 1 - stream->inputPos);
+      stream->inputPos = newline + 1;
+      return true;
+    } else if (stream->inputEnded) {
+      stream->done = stream->inputPos >= stream->input.size();
+      line->assign(stream->input, stream->inputPos, std::string::npos);
+      stream->inputPos = stream->input.size();
+      return !stream->done;
+    }
+
+    stream->input.erase(0, stream->inputPos);
+    stream->inputPos = 0;
+
+    char buf[65536];
+    ssize_t n = read(stream->scriptFD, buf, sizeof(buf));
+    if (n > 0) {
+      stream->input.append(buf, n);
+    } else if (n == 0) {
+      stream->inputEnded = true;
+    } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+      if (!stream->inputWatched) {
+        stream->inputWatched = watchStream(epollFD, stream, stream->scriptFD, WATCH_INPUT, EPOLLIN);
+      }
+      return false;
+    } else if (errno != EINTR) {
+      printf("ERROR: device %d: could not read %s (%s)\n", stream->index, stream->scriptPath, strerror(errno));
+      stream->failed = true;
+      stream->done = true;
+      return false;
+    }
+  }
+}
+
+//writes the next EVENT_BUFFER_SIZE of the stream's events up to writeEnd, in one write()
+//  when the sink reports EAGAIN, waits for it with epoll (and the timer, for the write timeout),
+//  without holding up the other streams
+//counts the dropped events if the write fails
+void writeStreamEvents(DeviceStream* stream, int epollFD) {
+  EventBuffer* evBuf = &stream->evBuf;
+  size_t endBytes = stream->writeEnd * sizeof(struct input_event);
+  size_t size = endBytes - stream->writtenBytes;
+  if (size > EVENT_BUFFER_SIZE * sizeof(struct input_event)) {
+    size = EVENT_BUFFER_SIZE * sizeof(struct input_event);
+  }
+
+  if (evBuf->sink.type == SINK_RECORD) {
+    //events are stamped once, not again after a short write
+    size_t start = (stream->writtenBytes + sizeof(struct input_event) - 1) / sizeof(struct input_event);
+    size_t end = (stream->writtenBytes + size) / sizeof(struct input_event);
+    if (start < end) {
+      stampEvents(&stream->events[start], end - start);
+    }
+  }
+
+  const char* data = (const char*)stream->events.data() + stream->writtenBytes;
+  ssize_t n;
+  do {
+    n = writeSink(evBuf, data, size);
+  } while (n < 0 && errno == EINTR);
+
+  if (n > 0) {
+    stream->writtenBytes += n;
+    if ((size_t)n < size) {
+      evBuf->shortWriteCount++;
+    }
+    return;
+  } else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+    evBuf->eagainCount++;
+    if (watchStream(epollFD, stream, evBuf->sink.fd, WATCH_OUTPUT, EPOLLOUT)) {
+      stream->blockedNanos = nowNanos();
+      armTimer(stream->timerFD, stream->blockedNanos + CONFIG.options.writeTimeoutMillis * 1000000LL);
+      return;
+    }
+    printf("ERROR: device %d: could not wait to write to %s (%s)\n",
+      stream->index, sinkName(&evBuf->sink), strerror(errno));
+  } else {
+    printf("ERROR: device %d: write to %s failed (%s)\n", stream->index, sinkName(&evBuf->sink),
+      n < 0 ? strerror(errno) : "no progress");
+  }
+  dropStreamEvents(stream);
+}
+
+//gives up on the events up to writeEnd, like flushEvents does when a write fails
+void dropStreamEvents(DeviceStream* stream) {
+  size_t endBytes = stream->writeEnd * sizeof(struct input_event);
+  stream->evBuf.failedWriteCount++;
+  stream->evBuf.droppedEventCount += (endBytes - stream->writtenBytes + sizeof(struct input_event) - 1) / sizeof(struct input_event);
+  stream->writtenBytes = endBytes;
+}
+
+//the epoll data of a watch is the stream's position in runDevices, and which of its fds it is
+bool watchStream(int epollFD, DeviceStream* stream, int fd, int watch, uint32_t events) {
+  struct epoll_event evt;
+  memset(&evt, 0, sizeof(evt));
+  evt.events = events;
+  evt.data.u64 = (uint64_t)(stream->index - 1) * WATCH_COUNT + watch;
+  return epoll_ctl(epollFD, EPOLL_CTL_ADD, fd, &evt) == 0;
+}
+
+//a deadline in the past expires immediately
+void armTimer(int timerFD, long long deadlineNanos) {
+  struct itimerspec spec;
+  memset(&spec, 0, sizeof(spec));
+  spec.it_value.tv_sec = deadlineNanos / 1000000000LL;
+  spec.it_value.tv_nsec = deadlineNanos % 1000000000LL;
+  timerfd_settime(timerFD, TFD_TIMER_ABSTIME, &spec, NULL);
 }
@@ -0,0 +1,89 @@
+//libudotool: creates a uinput device, and types strings, presses keys
+//  and moves pointers on it
+//  the udotool CLI is built from the same code (see udotool_internal.h)
+#ifndef UDOTOOL_H
+#define UDOTOOL_H
+
+#include <bitset>
+#include <memory>
+#include <string_view>
+
+#include <linux/uinput.h>
+
+//only what is marked with this is exported from libudotool.so
+#define UDOTOOL_API __attribute__((visibility("default")))
+
+//where flushed events go
+enum SinkType {
+  SINK_UINPUT, //a new uinput device
+  SINK_NULL,   //discarded, without a syscall, for benchmarks
+  SINK_RECORD, //input_event records appended to a file, timestamped when written
+};
+
+//pointer devices the uinput device also acts as, a bitmask
+enum {
+  POINTER_MOUSE = 1 << 0,
+  POINTER_TOUCH = 1 << 1,
+};
+
+//which EV_KEY codes the device advertises
+typedef std::bitset<KEY_CNT> KeySet;
+
+//the configuration of one Session, with the defaults of the udotool CLI
+//  deviceName, layout, pointerTypes and the touch size describe the device,
+//  so they are set before open(); the rest can change between calls
+struct SessionOptions {
+  const char* deviceName = "legacy uinput keyboard";
+  const char* layout = NULL; //a layout NAME or FILE, as for 'udotool --layout', or NULL for us
+  int keystrokeRate = 100;   //per second, 0 for unlimited, and changed by the 'rate' command
+  int keystrokeBurst = 1;    //keystrokes sent together at each deadline
+  int pointerTypes = 0;      //POINTER_* bitmask
+  int frameRate = 120;       //motion frames per second
+  int touchWidth = 1080;
+  int touchHeight = 1920;
+  long swipeMillis = 300;    //for a swipe without MILLIS
+  int writeTimeoutMillis = 1000;
+};
+
+struct SessionState;
+
+//a uinput device (or another sink), destroyed when the Session is
+//methods print an error and return false, and never exit()
+//Sessions share nothing that changes, so different Sessions can be used from different threads,
+//  but each one from one thread at a time
+class UDOTOOL_API Session {
+public:
+  explicit Session(const SessionOptions& options = SessionOptions());
+  ~Session();
+  Session(Session&& other) noexcept; //other can only be destroyed or assigned to afterwards
+  Session& operator=(Session&& other) noexcept;
+  Session(const Session&) = delete;
+  Session& operator=(const Session&) = delete;
+
+  SessionOptions& options();
+
+  //keys is what the device advertises, or NULL for every named key
+  //  path is the file of a SINK_RECORD sink
+  bool open(const KeySet* keys = NULL, int sinkType = SINK_UINPUT, const char* path = NULL);
+  void close();
+  bool isOpen() const;
+  const char* devPath() const; //e.g.: /dev/input/event5, or "" if it could not be found
+  long droppedEvents() const;  //events that could not be written, since open()
+
+  bool type(std::string_view str);
+  //keys is [MODS]KEY_NAME, as for 'udotool key', e.g.: "ctrl+shift+t", "enter", "keycode:28"
+  bool key(const char* keys); //press and release
+  bool keyDown(const char* keys);
+  bool keyUp(const char* keys);
+  bool command(const char* cmd, const char* arg); //any script command, e.g.: ("tap", "100 200")
+
+  //low-level: queue any event, and write everything queued with sync() or flush()
+  void event(int type, int code, int value);
+  bool sync(); //queues SYN_REPORT and flushes
+  bool flush();
+
+private:
+  std::unique_ptr<SessionState> state;
+};
+
+#endif
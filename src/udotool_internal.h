@@ -0,0 +1,306 @@
+//the internals of libudotool, shared with the udotool CLI
+//  nothing here is exported from libudotool.so, see udotool.h for the public API
+#ifndef UDOTOOL_INTERNAL_H
+#define UDOTOOL_INTERNAL_H
+
+#include <cstdio>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <string>
+#include <vector>
+
+#include "udotool.h"
+
+#ifndef LAYOUT_DIR
+#define LAYOUT_DIR "/usr/local/share/udotool/layouts"
+#endif
+
+struct KeyCmd {
+  char* keyName;
+  bool ctrl = false;
+  bool alt = false;
+  bool super = false;
+  bool forceShift = false;
+};
+
+struct EventSink {
+  int type;
+  int fd = -1;
+  char devPath[64] = ""; //e.g.: /dev/input/event5, for uinput when it could be detected
+  KeySet keys; //that the device reports, the kernel drops events of other keys
+  int pointerTypes = 0; //the POINTER_* types the device acts as
+};
+
+struct Config;
+
+//events are collected here and written to the sink with a single write() per flush
+//  config is what the commands run on the sink are compiled, paced and counted with
+#define EVENT_BUFFER_SIZE 1024
+struct EventBuffer {
+  EventSink sink;
+  Config* config = NULL;
+  struct input_event events[EVENT_BUFFER_SIZE];
+  int count = 0;
+
+  long writeCount = 0;
+  long eventCount = 0;
+  long eagainCount = 0;
+  long shortWriteCount = 0;
+  long failedWriteCount = 0;
+  long droppedEventCount = 0;
+};
+
+//keyCode 0 (KEY_RESERVED) means the character cannot be typed
+//  mods is a MOD_* bitmask, and deadKey is the 1-based index of a dead key
+//  in the layout that is typed first, or 0
+//also the on-disk format of layout files (see tools/compile-layout.py)
+struct CharKey {
+  uint16_t keyCode;
+  uint8_t mods;
+  uint8_t deadKey;
+};
+static_assert(sizeof(CharKey) == 4, "CharKey must be 4 bytes");
+
+struct CharKeyTable {
+  CharKey keys[256];
+};
+
+//a compiled layout file: a LayoutHeader, the dead keys, and then pages of
+//  256 CharKeys, so any code point is found with two array lookups
+#define LAYOUT_MAGIC "UDOTKBD1"
+#define LAYOUT_INDEX_SIZE 0x1100 //pages of 256 code points, up to U+10FFFF
+struct LayoutHeader {
+  char magic[8];
+  uint32_t pageCount;
+  uint32_t deadKeyCount;
+  uint16_t pageIndex[LAYOUT_INDEX_SIZE]; //page 0 is all empty
+};
+
+struct Layout {
+  const LayoutHeader* header = NULL; //NULL for the built-in US layout
+  const CharKey* deadKeys;
+  const CharKey* pages;
+  size_t mapSize = 0;
+};
+
+//schedules keystrokes on absolute deadlines, so sleeps do not accumulate drift
+struct Pacer {
+  int rate;  //keystrokes per second, 0 for unlimited
+  int burst; //keystrokes sent together at each deadline
+  long long startNanos;
+  long long endNanos;
+  long keystrokeCount = 0;
+};
+
+//modifier bitmask, in the order they are pressed
+enum {
+  MOD_SHIFT = 1 << 0,
+  MOD_CTRL  = 1 << 1,
+  MOD_ALT   = 1 << 2,
+  MOD_SUPER = 1 << 3,
+  MOD_ALTGR = 1 << 4,
+};
+const int MOD_KEYS[][2] = {
+  {MOD_SHIFT, KEY_LEFTSHIFT},
+  {MOD_CTRL,  KEY_LEFTCTRL},
+  {MOD_ALT,   KEY_LEFTALT},
+  {MOD_SUPER, KEY_LEFTMETA},
+  {MOD_ALTGR, KEY_RIGHTALT},
+};
+const int MOD_KEY_COUNT = sizeof(MOD_KEYS) / sizeof(MOD_KEYS[0]);
+
+//the flat list of events for a whole string, with the index after each keystroke
+struct TypePlan {
+  std::vector<struct input_event> events;
+  std::vector<size_t> keystrokeEnds;
+};
+
+//the flat list of events for a whole gesture, with the index after each frame
+//  every frame ends with SYN_REPORT, except frames with no motion, which are empty
+struct MotionPlan {
+  std::vector<struct input_event> events;
+  std::vector<size_t> frameEnds;
+  bool touching = false; //whether the finger is down, at the end of the plan
+};
+
+//any script command, compiled into frames of events, each due some nanos after the command starts
+//  the single-device path, the multi-device path and the --keys exact pre-scan all consume it
+//  'sleep' and 'rate' have no frames, and set sleepNanos or rate instead
+struct CommandPlan {
+  std::vector<struct input_event> events;
+  std::vector<size_t> frameEnds;     //each frame is written with one write()
+  std::vector<long long> frameNanos; //when each frame is due, from the start of the command
+  long keystrokeCount = 0;
+  int pointerTypes = 0;   //the POINTER_* types the events need
+  long long sleepNanos = 0; //nothing else is due until this long after the start
+  int rate = -1;          //the new keystroke rate, or -1
+};
+
+struct KeyName {
+  const char* name;
+  unsigned short keyCode;
+  bool shift;
+};
+
+//phases of a run, timed for --trace and --stats
+enum {
+  PHASE_PARSE,   //parsing arguments, compiling plans, and choosing keys
+  PHASE_OPEN,    //opening /dev/uinput
+  PHASE_SETUP,   //UI_SET_*BIT ioctls and UI_DEV_SETUP
+  PHASE_CREATE,  //UI_DEV_CREATE
+  PHASE_SETTLE,  //waiting for the device to be ready
+  PHASE_RUN,     //emitting events, including pacing sleeps
+  PHASE_DESTROY, //UI_DEV_DESTROY and close
+  PHASE_COUNT,
+};
+const char* const PHASE_NAMES[PHASE_COUNT] = {
+  "parse", "open", "setup", "create", "settle", "run", "destroy",
+};
+
+//latency histogram with 4 buckets per power of two nanoseconds
+#define LATENCY_BUCKET_COUNT (64 * 4)
+struct LatencyHistogram {
+  long long count = 0;
+  long long maxNanos = 0;
+  long long buckets[LATENCY_BUCKET_COUNT] = {};
+};
+
+struct Stats {
+  bool enabled = false;
+  bool trace = false; //print the time of each phase as it ends
+  long long lastMarkNanos;
+  long long phaseNanos[PHASE_COUNT] = {};
+  long long syscallCount = 0;
+  long long eventCount = 0;
+  long long byteCount = 0;
+  long long keystrokeCount = 0;
+  long long typingNanos = 0;
+  LatencyHistogram writeLatency;
+};
+
+enum {
+  STATS_OFF,
+  STATS_TEXT,
+  STATS_JSON,
+};
+
+//the configuration of a device and the commands run on it, and what those commands change
+//  (the 'rate' command, the next touch tracking id)
+//  each Session has its own, and the CLI has one, set from its options
+struct Config {
+  SessionOptions options;
+  Layout layout;           //loaded from options.layout
+  int touchTrackingId = 0;
+  bool reportRate = false; //print the rate of each 'type'
+  Stats* stats = NULL;     //where phase times and write counters go, or NULL
+};
+
+//the record/replay log: a LogHeader, followed by fixed-size LogRecords
+//  each record holds the microseconds since the previous one, so a log can be
+//  mapped and streamed from any size without parsing
+#define LOG_MAGIC "UDOTLOG1"
+struct LogHeader {
+  char magic[8];
+  uint32_t recordSize;
+  uint32_t reserved;
+};
+struct LogRecord {
+  uint32_t deltaMicros;
+  uint16_t type;
+  uint16_t code;
+  int32_t value;
+};
+static_assert(sizeof(LogHeader) == 16, "LogHeader must be 16 bytes");
+static_assert(sizeof(LogRecord) == 12, "LogRecord must be 12 bytes");
+
+//how the CLI chooses the KeySet of the device
+enum KeySetMode {
+  KEYS_AUTO,   //exactly what a single type/key command needs, otherwise every named key
+  KEYS_EXACT,  //like auto, and also exactly what a script FILE needs, found by reading it first
+  KEYS_NAMED,  //every key that has a hand-written key name or can be typed
+  KEYS_ALL,    //every key that has a key name (except buttons) or can be typed
+  KEYS_LEGACY, //keycodes 0-255, like older versions
+};
+
+bool openSink(EventSink* sink, int type, const char* path, const KeySet* keys, const Config* config);
+bool openSinks(EventSink* sinks, int count, int type, const char* path, const KeySet* keys, const Config* config);
+void closeSink(EventSink* sink, const Config* config);
+const char* sinkName(const EventSink* sink);
+int createDevice(const KeySet* keys, const char* name, const Config* config);
+bool setupDevice(int uinputFD, const char* name, const Config* config);
+void addBaseKeys(KeySet* keys);
+void addPointerKeys(KeySet* keys, int pointerTypes);
+void addNamedKeys(KeySet* keys, const Layout* layout);
+void addAllKeys(KeySet* keys, const Layout* layout);
+void addTypeableKeys(KeySet* keys, const Layout* layout);
+void addCommandKeys(KeySet* keys, const CommandPlan* plan);
+void addLegacyKeys(KeySet* keys);
+void closeDevice(int uinputFD);
+int watchDeviceDirs();
+bool waitForDevice(int uinputFD, int inotifyFD, char* devPath, size_t devPathSize);
+bool findEventNode(const char* sysName, char* eventName, size_t eventNameSize, unsigned* major, unsigned* minor);
+bool isDeviceReady(const char* devPath, const char* udevDataPath);
+long long nowNanos();
+void markPhase(Stats* stats, int phase);
+void recordLatency(LatencyHistogram* hist, long long nanos);
+int latencyBucket(long long nanos);
+long long latencyBucketNanos(int bucket);
+long long latencyPercentile(const LatencyHistogram* hist, double percentile);
+bool runCommand(EventBuffer* evBuf, const char* cmd, const char* arg);
+bool compileCommand(const char* cmd, const char* arg, Config* config, CommandPlan* plan);
+void planTypeFrames(CommandPlan* plan, TypePlan* typePlan, int rate, int burst);
+bool checkCommandPlan(const EventSink* sink, const CommandPlan* plan);
+bool emitCommandPlan(EventBuffer* evBuf, const CommandPlan* plan);
+bool parseSleepArg(const char* arg, long* millis);
+bool parseRateArg(const char* arg, long* rate);
+bool emitKeyEvent(EventBuffer* evBuf, int keyCode, bool pressed);
+bool queueEvent(EventBuffer* evBuf, int type, int code, int val);
+bool queueEvents(EventBuffer* evBuf, const struct input_event* events, int count);
+bool flushEvents(EventBuffer* evBuf);
+ssize_t writeSink(EventBuffer* evBuf, const char* data, size_t size);
+void stampEvents(struct input_event* events, int count);
+bool reportWriteErrors(EventBuffer* evBuf);
+bool compileTypePlan(const char* str, const Layout* layout, TypePlan* plan);
+void planKeyEvent(TypePlan* plan, int keyCode, bool pressed);
+void planModTransition(TypePlan* plan, int* curMods, int targetMods);
+void planCharKey(TypePlan* plan, int* mods, const Layout* layout, CharKey charKey);
+long decodeUtf8(const char* str, int* index);
+CharKey lookupCharKey(const Layout* layout, long codePoint);
+bool loadLayout(const char* layoutName, Layout* layout);
+void unloadLayout(Layout* layout);
+int motionCommandType(const char* cmd);
+bool compileMotionPlan(const char* cmd, const char* arg, Config* config, MotionPlan* plan);
+int parseMotionArgs(const char* cmd, const char* arg, long* values, int minCount, int maxCount, const Config* config);
+int motionFrameCount(long millis, const Config* config);
+void planMotionEvent(MotionPlan* plan, int type, int code, int value);
+void planMotionFrame(MotionPlan* plan);
+void planTouch(MotionPlan* plan, long x, long y, bool down, Config* config);
+int touchAxisMax(int axis, const Config* config);
+void initPacer(Pacer* pacer, int rate, int burst);
+void sleepUntil(long long deadlineNanos);
+void reportPacer(Pacer* pacer);
+bool extractKeyCmd(const char* keyCmdStr, KeyCmd* keyCmd);
+bool compileKeyCmd(KeyCmd keyCmd, bool press, bool release, TypePlan* plan);
+bool lookupKeyName(const char* keyName, int* keyCode, bool* shift);
+bool runScript(EventBuffer* evBuf, FILE* file);
+bool runScriptLine(EventBuffer* evBuf, char* line);
+bool splitScriptLine(char* line, char** cmd, char** arg);
+char* unescape(char* str);
+bool mapLog(const char* logPath, const LogRecord** records, size_t* recordCount, size_t* mapSize);
+void addLogKeys(KeySet* keys, const LogRecord* records, size_t recordCount);
+int logPointerTypes(const LogRecord* records, size_t recordCount);
+bool sinkReportsEvent(const EventSink* sink, int type, int code);
+bool replayLog(EventBuffer* evBuf, const LogRecord* records, size_t recordCount, double speed);
+
+//the same for every device, the rest of the configuration is in the Config of each one
+extern int DEVICE_INIT_DELAY_MILLIS; //fallback, when readiness cannot be detected
+extern int DEVICE_READY_TIMEOUT_MILLIS;
+extern int DEVICE_READY_SETTLE_MILLIS;
+
+extern int TOUCH_SLOT_COUNT;
+
+extern const char* DEV_INPUT_DIR;
+extern const char* UDEV_DATA_DIR;
+
+#endif
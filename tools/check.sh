@@ -0,0 +1,94 @@
+#!/bin/sh
+#run scripts into the record sink and compare the events they produce, without root or /dev/uinput
+#  usage: tools/check.sh [UDOTOOL]  (run by 'make check')
+#  events are compared as CODE+ and CODE- for key presses and releases, '/' for SYN_REPORT,
+#    and TYPE:CODE:VALUE for anything else
+#  records are read as 24-byte 'struct input_event', with a 64-bit timeval
+UDOTOOL="${1:-./udotool}"
+TMP="$(mktemp -d)"
+trap 'rm -rf "$TMP"' EXIT
+FAILED=0
+
+events() {
+  od -An -v -w24 -t u2 "$1" | awk '
+    {
+      value = $11 + $12 * 65536
+      if (value >= 2147483648) {
+        value -= 4294967296
+      }
+      if ($9 == 1 && value == 1) {
+        event = $10 "+"
+      } else if ($9 == 1 && value == 0) {
+        event = $10 "-"
+      } else if ($9 == 0 && $10 == 0) {
+        event = "/"
+      } else {
+        event = $9 ":" $10 ":" value
+      }
+      printf "%s%s", (NR > 1 ? " " : ""), event
+    }
+    END { printf "\n" }
+  '
+}
+
+#check NAME SCRIPT EXPECTED [OPTS]
+#  SCRIPT is unescaped by printf %b, so \n separates its lines
+check() {
+  name="$1"
+  script="$2"
+  expected="$3"
+  shift 3
+  rm -f "$TMP/events"
+  if ! printf '%b\n' "$script" | "$UDOTOOL" --rate 0 --output "record:$TMP/events" "$@" script - > "$TMP/output"; then
+    echo "FAIL: $name: udotool failed"
+    cat "$TMP/output"
+    FAILED=1
+    return
+  fi
+  actual="$(events "$TMP/events")"
+  if [ "$actual" != "$expected" ]; then
+    echo "FAIL: $name"
+    echo "  expected: $expected"
+    echo "  actual:   $actual"
+    FAILED=1
+  else
+    echo "ok: $name"
+  fi
+}
+
+#check_fails NAME SCRIPT [OPTS]
+check_fails() {
+  name="$1"
+  script="$2"
+  shift 2
+  if printf '%b\n' "$script" | "$UDOTOOL" --rate 0 --output "record:$TMP/events" "$@" script - > "$TMP/output"; then
+    echo "FAIL: $name: udotool succeeded"
+    FAILED=1
+  else
+    echo "ok: $name"
+  fi
+}
+
+check "type" "type ab" "42- / 30+ / 30- / 48+ / 48- /"
+check "type shifted" "type aBC!" "42- / 30+ / 30- / 42+ / 48+ / 48- / 46+ / 46- / 2+ / 2- / 42- /"
+check "type escapes" 'type a\\tb\\n' "42- / 30+ / 30- / 15+ / 15- / 48+ / 48- / 28+ / 28- /"
+check "type layout" "type zy" "42- / 21+ / 21- / 44+ / 44- /" --layout layouts/de.kbd
+check "key" "key ctrl+shift+home" "29+ / 42+ / 102+ / 102- / 42- / 29- /"
+check "keydown keyup" "keydown alt+f4\nkeyup alt+f4" "56+ / 62+ / 62- / 56- /"
+check "key keycode" "key keycode:28" "28+ / 28- /"
+check "key legacy" "key keycode:200" "200+ / 200- /" --keys legacy
+check "mousemove" "mousemove 10 -5" "2:0:10 2:1:-5 /" --pointer mouse
+check_fails "key not on the device" "key btn_left"
+check_fails "generated key name, not named" "key mute"
+check "generated key name, all" "key mute" "113+ / 113- /" --keys all
+check_fails "unknown command" "bogus 1"
+
+if "$UDOTOOL" bench 1000 > "$TMP/output"; then
+  echo "ok: bench"
+else
+  echo "FAIL: bench"
+  cat "$TMP/output"
+  FAILED=1
+fi
+
+exit $FAILED
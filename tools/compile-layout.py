@@ -0,0 +1,163 @@
+#!/usr/bin/env python3
+#compile an XKB-style layout description into the binary table udotool maps
+#  usage: tools/compile-layout.py LAYOUT.xkb LAYOUT.kbd
+#
+#description:
+#  one key per line, with up to four levels (none, shift, altgr, altgr+shift):
+#    key <AD01> { [ q, Q, at ] };
+#  a symbol is a single character (e.g.: ö), U+XXXX, an XKB name for ASCII
+#    punctuation (e.g.: exclam, braceleft), NoSymbol, or a dead key (e.g.: dead_acute)
+#  a dead key followed by a letter types every precomposed character that exists
+#    (e.g.: dead_acute + e types é), and followed by space types the accent itself,
+#    unless the character is on a key of its own
+#  newline, tab, escape and space are added if the description leaves them out
+#  '//' starts a comment
+#
+#binary format (native byte order, must match LayoutHeader and CharKey in udotool_internal.h):
+#  header:    char magic[8] = "UDOTKBD1", uint32 pageCount, uint32 deadKeyCount,
+#             uint16 pageIndex[0x1100], the page of each 256 code points
+#  dead keys: deadKeyCount CharKeys
+#  pages:     pageCount * 256 CharKeys, page 0 is empty
+#  CharKey:   uint16 keyCode, uint8 mods, uint8 deadKey (1-based index, 0 for none)
+
+import re
+import struct
+import sys
+import unicodedata
+
+MAGIC = b"UDOTKBD1"
+INDEX_SIZE = 0x1100
+
+#must match the MOD_* bitmask in udotool_internal.h
+MOD_SHIFT = 1 << 0
+MOD_ALTGR = 1 << 4
+LEVEL_MODS = [0, MOD_SHIFT, MOD_ALTGR, MOD_ALTGR | MOD_SHIFT]
+
+#XKB key names, as evdev keycodes
+XKB_KEYCODES = {
+  "TLDE": 41, "BKSL": 43, "LSGT": 86, "SPCE": 57,
+  "AE01": 2, "AE02": 3, "AE03": 4, "AE04": 5, "AE05": 6, "AE06": 7,
+  "AE07": 8, "AE08": 9, "AE09": 10, "AE10": 11, "AE11": 12, "AE12": 13,
+  "AD01": 16, "AD02": 17, "AD03": 18, "AD04": 19, "AD05": 20, "AD06": 21,
+  "AD07": 22, "AD08": 23, "AD09": 24, "AD10": 25, "AD11": 26, "AD12": 27,
+  "AC01": 30, "AC02": 31, "AC03": 32, "AC04": 33, "AC05": 34, "AC06": 35,
+  "AC07": 36, "AC08": 37, "AC09": 38, "AC10": 39, "AC11": 40,
+  "AB01": 44, "AB02": 45, "AB03": 46, "AB04": 47, "AB05": 48, "AB06": 49,
+  "AB07": 50, "AB08": 51, "AB09": 52, "AB10": 53,
+}
+
+IMPLICIT_KEYS = {"\n": 28, "\t": 15, "\033": 1, " ": 57}
+
+SYMBOL_NAMES = {
+  "space": " ", "exclam": "!", "quotedbl": "\"", "numbersign": "#",
+  "dollar": "$", "percent": "%", "ampersand": "&", "apostrophe": "'",
+  "parenleft": "(", "parenright": ")", "asterisk": "*", "plus": "+",
+  "comma": ",", "minus": "-", "period": ".", "slash": "/", "colon": ":",
+  "semicolon": ";", "less": "<", "equal": "=", "greater": ">",
+  "question": "?", "at": "@", "bracketleft": "[", "backslash": "\\",
+  "bracketright": "]", "asciicircum": "^", "underscore": "_", "grave": "`",
+  "braceleft": "{", "bar": "|", "braceright": "}", "asciitilde": "~",
+  "nobreakspace": "\u00a0", "section": "§", "degree": "°",
+  "currency": "¤", "EuroSign": "€",
+}
+
+#dead keys, as (combining character, spacing accent)
+DEAD_KEYS = {
+  "dead_grave": ("\u0300", "`"), "dead_acute": ("\u0301", "´"),
+  "dead_circumflex": ("\u0302", "^"), "dead_tilde": ("\u0303", "~"),
+  "dead_macron": ("\u0304", "¯"), "dead_breve": ("\u0306", "˘"),
+  "dead_abovedot": ("\u0307", "˙"), "dead_diaeresis": ("\u0308", "¨"),
+  "dead_abovering": ("\u030a", "˚"), "dead_doubleacute": ("\u030b", "˝"),
+  "dead_caron": ("\u030c", "ˇ"), "dead_cedilla": ("\u0327", "¸"),
+  "dead_ogonek": ("\u0328", "˛"),
+}
+
+KEY_LINE = re.compile(r"^key\s*<(\w+)>\s*\{\s*\[([^\]]*)\]\s*\}\s*;$")
+
+def fail(path, lineNum, msg):
+  sys.exit("ERROR: %s:%d: %s" % (path, lineNum, msg))
+
+def parseSymbol(path, lineNum, sym):
+  if sym in SYMBOL_NAMES:
+    return SYMBOL_NAMES[sym]
+  elif sym == "NoSymbol" or sym in DEAD_KEYS:
+    return sym
+  elif re.match(r"^U\+[0-9A-Fa-f]{4,6}$", sym):
+    return chr(int(sym[2:], 16))
+  elif len(sym) == 1:
+    return sym
+  fail(path, lineNum, "unknown symbol %s" % sym)
+
+def compileLayout(path):
+  chars = {} #character => (keyCode, mods, deadKey)
+  deadKeys = [] #(keyCode, mods)
+  deadKeyNames = []
+
+  with open(path, encoding="utf-8") as f:
+    for lineNum, line in enumerate(f, 1):
+      line = line.split("//")[0].strip()
+      if line == "" or line.startswith("xkb_symbols") or line in ["{", "};"]:
+        continue
+      m = KEY_LINE.match(line)
+      if not m:
+        fail(path, lineNum, "expected: key <NAME> { [ SYMBOLS ] };")
+      if m.group(1) not in XKB_KEYCODES:
+        fail(path, lineNum, "unknown key <%s>" % m.group(1))
+      keyCode = XKB_KEYCODES[m.group(1)]
+
+      syms = [s.strip() for s in m.group(2).split(",")]
+      if len(syms) > len(LEVEL_MODS):
+        fail(path, lineNum, "more than %d levels" % len(LEVEL_MODS))
+      for level, sym in enumerate(syms):
+        sym = parseSymbol(path, lineNum, sym)
+        mods = LEVEL_MODS[level]
+        if sym in DEAD_KEYS:
+          if sym not in deadKeyNames:
+            deadKeyNames.append(sym)
+            deadKeys.append((keyCode, mods))
+        elif sym != "NoSymbol" and sym not in chars:
+          chars[sym] = (keyCode, mods, 0)
+
+  for ch, keyCode in IMPLICIT_KEYS.items():
+    chars.setdefault(ch, (keyCode, 0, 0))
+
+  if len(deadKeys) > 255:
+    sys.exit("ERROR: %s: more than 255 dead keys" % path)
+  bases = sorted(chars.items())
+  for i, name in enumerate(deadKeyNames):
+    combining, spacing = DEAD_KEYS[name]
+    for base, (keyCode, mods, deadKey) in bases:
+      if deadKey != 0:
+        continue
+      composed = spacing if base == " " else unicodedata.normalize("NFC", base + combining)
+      if len(composed) == 1 and composed not in chars:
+        chars[composed] = (keyCode, mods, i + 1)
+  return chars, deadKeys
+
+def writeLayout(outPath, chars, deadKeys):
+  pageIndex = [0] * INDEX_SIZE
+  pages = [[(0, 0, 0)] * 256]
+  for ch in sorted(chars):
+    cp = ord(ch)
+    if pageIndex[cp >> 8] == 0:
+      pageIndex[cp >> 8] = len(pages)
+      pages.append([(0, 0, 0)] * 256)
+    pages[pageIndex[cp >> 8]][cp & 0xff] = chars[ch]
+
+  with open(outPath, "wb") as f:
+    f.write(struct.pack("=8sII", MAGIC, len(pages), len(deadKeys)))
+    f.write(struct.pack("=%dH" % INDEX_SIZE, *pageIndex))
+    for keyCode, mods in deadKeys:
+      f.write(struct.pack("=HBB", keyCode, mods, 0))
+    for page in pages:
+      for keyCode, mods, deadKey in page:
+        f.write(struct.pack("=HBB", keyCode, mods, deadKey))
+
+def main():
+  if len(sys.argv) != 3:
+    sys.exit("Usage: %s LAYOUT.xkb LAYOUT.kbd" % sys.argv[0])
+  chars, deadKeys = compileLayout(sys.argv[1])
+  writeLayout(sys.argv[2], chars, deadKeys)
+
+if __name__ == "__main__":
+  main()
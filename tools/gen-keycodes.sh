@@ -0,0 +1,34 @@
+#!/bin/sh
+#generate src/keycodes.inc, the KEY_NAMES entries for every KEY_* and BTN_* code
+#  usage: tools/gen-keycodes.sh [INPUT_EVENT_CODES_H] > src/keycodes.inc
+#  KEY_ is dropped from names, BTN_ is kept (BTN_0 and KEY_0 would collide)
+#  range markers (KEY_MAX, KEY_CNT, KEY_RESERVED, KEY_MIN_INTERESTING) are skipped
+#  codes are written as numbers (aliases like KEY_SCREENLOCK resolved), with the name
+#    in a comment, so that the table builds against kernel headers older than the one
+#    it was generated from
+HEADER="${1:-/usr/include/linux/input-event-codes.h}"
+
+echo "//generated by tools/gen-keycodes.sh from linux/input-event-codes.h, do not edit"
+awk '
+  function resolve(value) {
+    while (value in codes) {
+      value = codes[value]
+    }
+    return value
+  }
+  #the first pass reads every code, so that aliases can refer to any of them
+  NR == FNR {
+    if ($1 == "#define" && $2 ~ /^(KEY|BTN)_[A-Z0-9_]+$/) {
+      codes[$2] = $3
+    }
+    next
+  }
+  $1 == "#define" && $2 ~ /^(KEY|BTN)_[A-Z0-9_]+$/ {
+    if ($2 ~ /^KEY_(MAX|CNT|RESERVED|MIN_INTERESTING)$/) {
+      next
+    }
+    name = tolower($2)
+    sub(/^key_/, "", name)
+    printf "  {%-20s %-6s false}, //%s\n", "\"" name "\",", resolve($3) ",", $2
+  }
+' "$HEADER" "$HEADER"